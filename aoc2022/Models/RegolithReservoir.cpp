@@ -6,9 +6,15 @@
 //
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
 #include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
 #include <optional>
-#include <sstream>
 #include <string>
 #include <string_view>
 #include <thread>
@@ -30,253 +36,494 @@ bool Bounds::includes(int x, int y) const {
     y >= this->y && y < (this->y + this->height);
 }
 
-CaveIterator& CaveIterator::operator++() {
-    if (++cell != this->column->second.end()) {
-        return *this;
-    } else {
-        if (++this->column != buckets->get().end()) {
-            cell = this->column->second.begin();
-            assert(cell != this->column->second.end());
-            return *this;
-        } else {
-            buckets = std::nullopt;
-            return *this;
+void BoundsTracker::insert(Coordinate coordinate) {
+    if (this->stale) {
+        // Everything is counted again when the bounds are needed.
+        return;
+    }
+
+    if (this->empty) {
+        this->left = this->right = coordinate.x;
+        this->top = this->bottom = coordinate.y;
+        this->leftCount = this->rightCount = this->topCount = this->bottomCount = 0;
+        this->empty = false;
+    }
+
+    if (coordinate.x < this->left) {
+        this->left = coordinate.x;
+        this->leftCount = 0;
+    } else if (coordinate.x > this->right) {
+        this->right = coordinate.x;
+        this->rightCount = 0;
+    }
+    if (coordinate.y < this->top) {
+        this->top = coordinate.y;
+        this->topCount = 0;
+    } else if (coordinate.y > this->bottom) {
+        this->bottom = coordinate.y;
+        this->bottomCount = 0;
+    }
+
+    this->leftCount += coordinate.x == this->left;
+    this->rightCount += coordinate.x == this->right;
+    this->topCount += coordinate.y == this->top;
+    this->bottomCount += coordinate.y == this->bottom;
+}
+
+/// Counts the cells of the segments on a line, each cell once, and the
+/// ones of them that were already occupied, if there is a way to tell.
+template <typename OnLine>
+static std::pair<int, int> countOnLine(Wall const& wall, OnLine onLine, std::function<bool(int)> const& isOccupied) {
+    std::vector<Interval> intervals;
+    for (auto const& segment : wall.segments) {
+        if (auto interval = onLine(segment)) {
+            intervals.push_back(*interval);
+        }
+    }
+    std::sort(intervals.begin(), intervals.end(), [] (Interval lhs, Interval rhs) {
+        return lhs.from < rhs.from;
+    });
+
+    int count = 0, occupied = 0;
+    std::optional<int> next;
+    for (auto interval : intervals) {
+        int from = next ? std::max(interval.from, *next) : interval.from;
+        if (from > interval.to) {
+            continue;
+        }
+        count += interval.to - from + 1;
+        if (isOccupied) {
+            for (int value = from; value <= interval.to; ++value) {
+                occupied += isOccupied(value);
+            }
+        }
+        next = interval.to + 1;
+    }
+    return { count, occupied };
+}
+
+void BoundsTracker::insert(Wall const& wall, std::function<bool(Coordinate)> const& isOccupied) {
+    if (this->stale || wall.segments.empty()) {
+        return;
+    }
+
+    auto previous = *this;
+    if (this->empty) {
+        auto first = wall.segments.front().coordinates.first;
+        this->left = this->right = first.x;
+        this->top = this->bottom = first.y;
+        this->empty = false;
+    }
+    for (auto const& segment : wall.segments) {
+        for (auto coordinate : { segment.coordinates.first, segment.coordinates.second }) {
+            this->left = std::min(this->left, coordinate.x);
+            this->right = std::max(this->right, coordinate.x);
+            this->top = std::min(this->top, coordinate.y);
+            this->bottom = std::max(this->bottom, coordinate.y);
+        }
+    }
+
+    // An edge that moved out has none of the cells counted before.
+    // On one that stayed, the walls may cover some of them.
+    auto countColumn = [&] (int x, bool stayed, int count) {
+        std::function<bool(int)> isOccupiedInColumn;
+        if (stayed && count > 0) {
+            isOccupiedInColumn = [&] (int y) { return isOccupied({ x, y }); };
+        }
+        auto [cells, occupied] = countOnLine(wall, [x] (Segment const& segment) -> std::optional<Interval> {
+            auto [from, to] = segment.coordinates;
+            if (std::min(from.x, to.x) <= x && x <= std::max(from.x, to.x)) {
+                return Interval { std::min(from.y, to.y), std::max(from.y, to.y) };
+            }
+            return std::nullopt;
+        }, isOccupiedInColumn);
+        return (stayed ? count : 0) + cells - occupied;
+    };
+    auto countRow = [&] (int y, bool stayed, int count) {
+        std::function<bool(int)> isOccupiedInRow;
+        if (stayed && count > 0) {
+            isOccupiedInRow = [&] (int x) { return isOccupied({ x, y }); };
         }
+        auto [cells, occupied] = countOnLine(wall, [y] (Segment const& segment) -> std::optional<Interval> {
+            auto [from, to] = segment.coordinates;
+            if (std::min(from.y, to.y) <= y && y <= std::max(from.y, to.y)) {
+                return Interval { std::min(from.x, to.x), std::max(from.x, to.x) };
+            }
+            return std::nullopt;
+        }, isOccupiedInRow);
+        return (stayed ? count : 0) + cells - occupied;
+    };
+    bool wasEmpty = previous.empty;
+    this->leftCount = countColumn(this->left, !wasEmpty && this->left == previous.left, previous.leftCount);
+    this->rightCount = countColumn(this->right, !wasEmpty && this->right == previous.right, previous.rightCount);
+    this->topCount = countRow(this->top, !wasEmpty && this->top == previous.top, previous.topCount);
+    this->bottomCount = countRow(this->bottom, !wasEmpty && this->bottom == previous.bottom, previous.bottomCount);
+}
+
+void BoundsTracker::erase(Coordinate coordinate) {
+    if (!this->isOnEdge(coordinate)) {
+        // The bounds stay the same.
+        return;
+    }
+
+    if ((coordinate.x == this->left && --this->leftCount == 0) |
+        (coordinate.x == this->right && --this->rightCount == 0) |
+        (coordinate.y == this->top && --this->topCount == 0) |
+        (coordinate.y == this->bottom && --this->bottomCount == 0)) {
+        this->stale = true;
+    }
+}
+
+void BoundsTracker::reset(Bounds bounds, std::function<bool(Coordinate)> const& isOccupied) {
+    *this = BoundsTracker {};
+    if (bounds.width <= 0 || bounds.height <= 0) {
+        // There are no cells.
+        return;
+    }
+
+    this->left = bounds.x;
+    this->right = bounds.x + bounds.width - 1;
+    this->top = bounds.y;
+    this->bottom = bounds.y + bounds.height - 1;
+    this->empty = false;
+    for (int x = this->left; x <= this->right; ++x) {
+        this->topCount += isOccupied({ x, this->top });
+        this->bottomCount += isOccupied({ x, this->bottom });
+    }
+    for (int y = this->top; y <= this->bottom; ++y) {
+        this->leftCount += isOccupied({ this->left, y });
+        this->rightCount += isOccupied({ this->right, y });
+    }
+}
+
+Bounds BoundsTracker::getBounds() const {
+    assert(!this->stale);
+    return { this->left, this->top, this->right - this->left + 1, this->bottom - this->top + 1 };
+}
+
+CaveIterator& CaveIterator::operator++() {
+    this->cell = this->cave->get().next(this->cell->getCoordinate());
+    if (!this->cell) {
+        this->cave = std::nullopt;
     }
+    return *this;
 }
 
-Cell const& CaveIterator::operator*() {
-    return cell->second;
+Cell const& CaveIterator::operator*() const {
+    return *this->cell;
 }
 
 bool operator==(CaveIterator const& lhs, CaveIterator const& rhs) {
-    return (!lhs.buckets.has_value() && !rhs.buckets.has_value()) ||
-            (&lhs.buckets->get() == &rhs.buckets->get() &&
-             lhs.column == rhs.column &&
-             lhs.cell == rhs.cell);
+    return (!lhs.cave.has_value() && !rhs.cave.has_value()) ||
+            (lhs.cave.has_value() && rhs.cave.has_value() &&
+             &lhs.cave->get() == &rhs.cave->get() &&
+             lhs.cell->getCoordinate() == rhs.cell->getCoordinate());
 }
 
-Cave::Cave(): buckets({}), floor(Oblivion {}) {
-    this->insertCell(Cell { CellType::Spawn, SPAWN_POINT});
+Cell Cave::CellRef::operator * () const {
+    if (auto type = std::visit([this] (auto const& storage) {
+        return storage.find(this->coordinate);
+    }, this->cave.get().storage)) {
+        return { *type, this->coordinate };
+    } else {
+        // The cell has moved or disappeared since the reference was
+        // taken.
+        throw CppErrorCodeState;
+    }
 }
 
-auto Cave::begin() const {
-    return CaveIterator {
-        this->buckets,
-        this->buckets.begin(),
-        this->buckets.begin()->second.begin(),
-    };
+void Cave::CellRef::setType(CellType type) {
+    auto& cave = this->cave.get();
+    assert(!cave.isEmpty(this->coordinate));
+    cave.insertCell({ type, this->coordinate });
 }
 
-auto Cave::end() const {
-    return CaveIterator { std::nullopt };
+static std::variant<BucketStorage, GridStorage, TileStorage> makeStorage(Storage storage) {
+    switch (storage) {
+        case Storage::Buckets:
+            return BucketStorage {};
+
+        case Storage::Grid:
+            return GridStorage {};
+
+        case Storage::Tiles:
+            return TileStorage {};
+    }
+    throw CppErrorCodeLogic;
 }
 
-template <typename T>
-void Cave::insertObject(T&& object) {
-    for (auto&& obj : object.intoCells()) {
-        this->insertCell(std::move(obj));
+/// Throws <code>CppErrorCodeInput</code> unless the spawn points are
+/// distinct and all on the row of <code>SPAWN_POINT</code>.
+static void checkSpawnPoints(std::vector<Coordinate> const& spawnPoints) {
+    if (spawnPoints.empty()) {
+        throw CppErrorCodeInput;
+    }
+    for (auto point = spawnPoints.begin(); point != spawnPoints.end(); ++point) {
+        if (point->y != SPAWN_POINT.y || std::find(spawnPoints.begin(), point, *point) != point) {
+            throw CppErrorCodeInput;
+        }
     }
 }
 
-Cave::IteratorToCell Cave::insertCell(Cell&& cell) {
-    auto& bucket = buckets[cell.getCoordinate().x];
-    auto [it, _] = bucket.insert_or_assign(cell.getCoordinate().y, std::move(cell));
-    return it;
+Cave::Cave(Storage storage, std::vector<Coordinate> const& spawnPoints, SpawnPolicy spawnPolicy):
+    storage(makeStorage(storage)), floor(Oblivion {}), spawnPoints(spawnPoints), spawnPolicy(spawnPolicy) {
+    checkSpawnPoints(this->spawnPoints);
+    for (auto spawnPoint : this->spawnPoints) {
+        this->insertCell(Cell { CellType::Spawn, spawnPoint });
+    }
 }
 
-void Cave::removeCell(Coordinate coordinate) {
-    int bucket_key = coordinate.x;
-    auto& bucket = buckets[bucket_key];
-    std::erase_if(bucket, [&coordinate] (auto const& item) { return item.first == coordinate.y; });
+CaveIterator Cave::begin() const {
+    if (auto first = this->next(std::nullopt)) {
+        return CaveIterator { *this, first };
+    } else {
+        return this->end();
+    }
+}
+
+CaveIterator Cave::end() const {
+    return CaveIterator { std::nullopt, std::nullopt };
+}
+
+std::optional<Cell> Cave::next(std::optional<Coordinate> after) const {
+    return std::visit([after] (auto const& storage) {
+        return storage.next(after);
+    }, this->storage);
+}
+
+void Cave::insertWall(Wall const& wall) {
+    if (auto grid = std::get_if<GridStorage>(&this->storage); grid && !wall.segments.empty()) {
+        // Lay the grid out once for the whole wall, rather than growing
+        // it again for each of the segments.  The other storages only
+        // keep what's inserted, so they don't need the space up front.
+        auto first = wall.segments.front().coordinates.first;
+        int left = first.x, right = first.x, top = first.y, bottom = first.y;
+        for (auto const& segment : wall.segments) {
+            for (auto coordinate : { segment.coordinates.first, segment.coordinates.second }) {
+                left = std::min(left, coordinate.x);
+                right = std::max(right, coordinate.x);
+                top = std::min(top, coordinate.y);
+                bottom = std::max(bottom, coordinate.y);
+            }
+        }
+        grid->reserve({ left, top, right - left + 1, bottom - top + 1 });
+    }
+
+    // Count the walls before they are in the storage, so that only
+    // the cells that were there already are looked up.
+    this->bounds.insert(wall, [this] (Coordinate coordinate) {
+        return !this->isEmpty(coordinate);
+    });
+
+    for (auto const& segment : wall.segments) {
+        std::visit([&segment] (auto& storage) {
+            storage.insertSegment(segment);
+        }, this->storage);
+    }
+}
+
+Cave::CellRef Cave::insertCell(Cell&& cell) {
+    auto coordinate = cell.getCoordinate();
+    if (!this->bounds.isOnEdge(coordinate) || this->isEmpty(coordinate)) {
+        this->bounds.insert(coordinate);
+    }
+
+    std::visit([&cell] (auto& storage) {
+        storage.insert(std::move(cell));
+    }, this->storage);
+    return { *this, coordinate };
 }
 
-void Cave::removeCell(IteratorToCell iterator) {
-    int bucket_key = iterator->second.getCoordinate().x;
-    auto bucket = buckets.find(bucket_key);
-    bucket->second.erase(iterator);
-    if (bucket->second.empty()) {
-        buckets.erase(bucket);
+void Cave::removeCell(Coordinate coordinate) {
+    if (this->bounds.isOnEdge(coordinate) && !this->isEmpty(coordinate)) {
+        this->bounds.erase(coordinate);
     }
+
+    std::visit([coordinate] (auto& storage) {
+        storage.erase(coordinate);
+    }, this->storage);
 }
 
-Cave::IteratorToCell Cave::relocate(IteratorToCell iterator, Coordinate to) {
-    auto& cell = iterator->second;
+void Cave::removeCell(CellRef cell) {
+    this->removeCell(cell.getCoordinate());
+}
+
+Cave::CellRef Cave::relocate(CellRef cell, Coordinate to) {
     if (cell.getCoordinate() != to) {
         auto targetCell = findCell(to);
         if (targetCell.has_value()) {
             throw CppErrorCodeState;
         } else {
-            Cell inTransit = std::move(cell);
-            this->removeCell(iterator);
-            inTransit.setCoordinate(to);
-            return this->insertCell(std::move(inTransit));
+            std::visit([from = cell.getCoordinate(), to] (auto& storage) {
+                storage.move(from, to);
+            }, this->storage);
+            // Count the new position first, so that a cell moving along
+            // an edge doesn't leave it empty for a moment.
+            this->bounds.insert(to);
+            this->bounds.erase(cell.getCoordinate());
+            return { *this, to };
         }
     } else {
         // Nothing needs to be done.
-        return iterator;
+        return cell;
     }
 }
 
-std::optional<Cave::IteratorToCell> Cave::findCell(Coordinate coordinate) {
-    int bucket_key = coordinate.x;
-    auto it = buckets.find(bucket_key);
-    if (it == buckets.end()) {
-        return std::nullopt;
-    }
+void Cave::reserve(Bounds bounds) {
+    std::visit([bounds] (auto& storage) {
+        storage.reserve(bounds);
+    }, this->storage);
+}
 
-    auto& cells = it->second;
-    auto point = cells.lower_bound(coordinate.y);
-    if (point != cells.end() && point->second.getCoordinate() == coordinate) {
-        return point;
-    } else {
+std::optional<Cave::CellRef> Cave::findCell(Coordinate coordinate) {
+    if (this->isEmpty(coordinate)) {
         return std::nullopt;
+    } else {
+        return CellRef { *this, coordinate };
     }
 }
 
 std::optional<Coordinate> Cave::findObjectBelow(Coordinate coordinate) const {
-    int bucket_key = coordinate.x;
-    auto it = buckets.find(bucket_key);
-    if (it == buckets.end()) {
-        return std::nullopt;
-    } else {
-        auto& cells = it->second;
-        auto candidate = cells.upper_bound(coordinate.y);
-
-        if (candidate != cells.end()) {
-            return candidate->second.getCoordinate();
-        } else {
-            // If an object would fall to the endless depth.
-            return std::nullopt;
-        }
-    }
+    return std::visit([coordinate] (auto const& storage) {
+        return storage.findObjectBelow(coordinate);
+    }, this->storage);
 }
 
 auto Cave::getSpawnCell() -> CellRef {
-    auto spawnCell = this->findCell(SPAWN_POINT);
+    auto spawnCell = this->findCell(this->spawnPoints.front());
     assert(spawnCell);
     return { *spawnCell };
 }
 
-/// Spawns a new sand cell at SPAWN\_POINT.
+bool Cave::isSpawnPoint(Coordinate coordinate) const {
+    return std::find(this->spawnPoints.begin(), this->spawnPoints.end(), coordinate) != this->spawnPoints.end();
+}
+
+bool Cave::isSpawnBlocked() const {
+    return std::all_of(this->spawnPoints.begin(), this->spawnPoints.end(), [this] (Coordinate spawnPoint) {
+        return !this->isVacantSpawnPoint(spawnPoint);
+    });
+}
+
+Coordinate Cave::nextSpawnPoint() {
+    auto count = this->spawnPoints.size();
+    for (size_t turn = 0; turn < count; ++turn) {
+        auto index = this->spawnPolicy == SpawnPolicy::RoundRobin
+            ? (this->nextSpawnIndex + turn) % count
+            : turn;
+        if (this->isVacantSpawnPoint(this->spawnPoints[index])) {
+            this->nextSpawnIndex = (index + 1) % count;
+            return this->spawnPoints[index];
+        }
+    }
+    throw CppErrorCodeState;
+}
+
+/// Spawns a new sand cell at the spawn point.
 ///
-/// Returns the iterator to the spawn cell.
-Cave::IteratorToCell Cave::spawnSand() {
-    auto spawnCell = this->getSpawnCell();
-    assert(spawnCell->getType() == CellType::Spawn);
+/// Returns the reference to the spawn cell.
+Cave::CellRef Cave::spawnSand(Coordinate spawnPoint) {
+    auto spawnCell = this->findCell(spawnPoint);
+    assert(spawnCell && spawnCell->getType() == CellType::Spawn);
     spawnCell->setType(CellType::SandBlockingSpawn);
-    return spawnCell;
+    return *spawnCell;
+}
+
+bool Cave::isVacantSpawnPoint(Coordinate spawnPoint) const {
+    auto type = std::visit([spawnPoint] (auto const& storage) {
+        return storage.find(spawnPoint);
+    }, this->storage);
+    return type == CellType::Spawn;
 }
 
 bool Cave::isWall(Coordinate coordinate) const {
-    int bucket_key = coordinate.x;
-    auto it = buckets.find(bucket_key);
-    if (it == buckets.end()) {
-        return false;
-    } else {
-        for (auto const& [y, obj] : it->second) {
-            if (y == coordinate.y) {
-                return obj.getType() == CellType::Wall;
-            }
-        }
-        return false;
-    }
+    auto type = std::visit([coordinate] (auto const& storage) {
+        return storage.find(coordinate);
+    }, this->storage);
+    return type == CellType::Wall;
 }
 
 bool Cave::isEmpty(Coordinate coordinate) const {
-    int bucket_key = coordinate.x;
-    auto it = buckets.find(bucket_key);
-    if (it == buckets.end()) {
-        return true;
-    } else {
-        return std::end(it->second) == std::find_if(std::begin(it->second), std::end(it->second), [&coordinate] (auto const& item) { return item.first == coordinate.y; });
-    }
+    auto type = std::visit([coordinate] (auto const& storage) {
+        return storage.find(coordinate);
+    }, this->storage);
+    return !type.has_value();
 }
 
 Bounds Cave::calculateBounds() const {
-    int min_x = std::numeric_limits<int>::max();
-    int max_x = std::numeric_limits<int>::min();
-    int min_y = std::numeric_limits<int>::max();
-    int max_y = std::numeric_limits<int>::min();
-
-    for (auto const& [x, bucket] : buckets) {
-        min_x = std::min(min_x, x);
-        max_x = std::max(max_x, x);
-        for (auto const& [y, cell] : bucket) {
-            min_y = std::min(min_y, y);
-            max_y = std::max(max_y, y);
-        }
-    }
+    // Stale bounds are calculated from the cells, without counting
+    // them again.
+    auto bounds = this->bounds.isStale()
+        ? std::visit([] (auto const& storage) {
+            return storage.calculateBounds();
+        }, this->storage)
+        : this->bounds.getBounds();
 
     if (auto floor = this->floor.getHorizontalFloor()) {
         // Include the cave floor in the bounds.
-        max_y = *floor;
+        bounds.height = *floor - bounds.y + 1;
     }
 
-    return { min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
+    return bounds;
+}
+
+void Cave::refreshBounds() {
+    if (this->bounds.isStale()) {
+        auto bounds = std::visit([] (auto const& storage) {
+            return storage.calculateBounds();
+        }, this->storage);
+        this->bounds.reset(bounds, [this] (Coordinate coordinate) {
+            return !this->isEmpty(coordinate);
+        });
+    }
 }
 
+/// The character of each type of cell, indexed by <code>CellType</code>.
+static constexpr std::array<char, 4> CHARACTERS_OF_CELLS = [] {
+    std::array<char, 4> characters {};
+    characters[static_cast<size_t>(CellType::Wall)] = '#';
+    characters[static_cast<size_t>(CellType::Sand)] = 'o';
+    characters[static_cast<size_t>(CellType::Spawn)] = '+';
+    characters[static_cast<size_t>(CellType::SandBlockingSpawn)] = 'o';
+    return characters;
+}();
+
 void PrintingPress::load(Cave const& cave) {
     this->bounds = cave.calculateBounds();
 
-    // Resize the grid to the size of the cave
-    int width = this->bounds->width;
-    int height = this->bounds->height;
+    int width = std::max(0, this->bounds->width);
+    int height = std::max(0, this->bounds->height);
+    size_t stride = static_cast<size_t>(width) + 1;
 
-    this->grid.resize(height, std::vector<CellState>(width, CellState::Empty));
+    // Fill the whole cave with empty space, and end every row.
+    this->raster.assign(stride * height, '.');
+    for (size_t end = width; end < this->raster.size(); end += stride) {
+        this->raster[end] = '\n';
+    }
 
     for (auto const& cell : cave) {
         int x = cell.getCoordinate().x - this->bounds->x;
         int y = cell.getCoordinate().y - this->bounds->y;
 
         if (x >= 0 && x < width && y >= 0 && y < height) {
-            if (cell.getType() == CellType::Sand) {
-                grid[y][x] = CellState::Sand;
-            } else if (cell.getType() == CellType::SandBlockingSpawn) {
-                grid[y][x] = CellState::Sand;
-            } else if (cell.getType() == CellType::Wall) {
-                grid[y][x] = CellState::Wall;
-            } else if (cell.getType() == CellType::Spawn) {
-                grid[y][x] = CellState::Spawn;
-            }
+            this->raster[y * stride + x] = CHARACTERS_OF_CELLS[static_cast<size_t>(cell.getType())];
         }
     }
 
-    if (cave.hasHorizontalFloor()) {
+    if (cave.hasHorizontalFloor() && height > 0) {
         // Render the floor as a horizontal wall across the bottom of
         // the cave.
-        for (int x = 0; x < width; x++) {
-            grid[height - 1][x] = CellState::Wall;
-        }
+        std::fill_n(this->raster.begin() + (height - 1) * stride, width, '#');
     }
 }
 
-std::string PrintingPress::printCave() const {
-    std::stringstream ss;
-
-    for (const auto& row : this->grid) {
-        for (const auto& cellState : row) {
-            char cellRepresentation;
-            switch (cellState) {
-                case CellState::Empty:
-                    cellRepresentation = '.';
-                    break;
-                case CellState::Sand:
-                    cellRepresentation = 'o';
-                    break;
-                case CellState::Wall:
-                    cellRepresentation = '#';
-                    break;
-                case CellState::Spawn:
-                    cellRepresentation = '+';
-                    break;
-            }
-            ss << cellRepresentation;
-        }
-        ss << std::endl;
+Physics::Physics(Cave& cave, bool enableTrace): cave(cave), trajectories(cave.getSpawnPoints().size()) {
+#ifdef DEBUG
+    enableTrace = true;
+#endif
+    if (enableTrace) {
+        this->trace = Trace { Trace::DEFAULT_CAPACITY };
     }
-
-    return std::move(ss).str();
 }
 
 std::optional<Coordinate> Physics::simulate(Cave::CellRef cellToSimulate) {
@@ -290,26 +537,6 @@ std::optional<Coordinate> Physics::simulate(Cave::CellRef cellToSimulate) {
         Cave::CellRef cell;
         std::variant<LeaveSpawn, Fall, Slide, Rest, Destroy> how;
 
-        operator Event const() {
-            std::ostringstream out;
-            out << "CHANGE:[TYPE:";
-            if (auto action = std::get_if<LeaveSpawn>(&how)) {
-                out << "LeaveSpawn," << action->target;
-            } else if (auto action = std::get_if<Fall>(&how)) {
-                out << "Fall," << action->target;
-            } else if (auto action = std::get_if<Slide>(&how)) {
-                out << "Slide," << action->target;
-            } else if (std::holds_alternative<Rest>(how)) {
-                out << "Rest";
-            } else if (std::holds_alternative<Destroy>(how)) {
-                out << "Destroy";
-            } else {
-                assert(false);
-                throw CppErrorCodeState;
-            }
-            out << "]";
-            return out.str();
-        }
     };
 
     bool running = true;
@@ -317,13 +544,13 @@ std::optional<Coordinate> Physics::simulate(Cave::CellRef cellToSimulate) {
 
     std::optional<Cave::CellRef> active = cellToSimulate;
 
-    History history;
-    history.add("ACTIVE: " + *cellToSimulate);
+    auto grain = this->grains++;
+    this->trace.record(grain, TraceAction::Spawn, cellToSimulate.getCoordinate(), cellToSimulate.getCoordinate());
 
     while (running) {
         std::optional<Change> change = std::nullopt;
         assert(active);
-        Cell& sand = **active;
+        Cell sand = **active;
         auto coordinate = sand.getCoordinate();
 
         assert(sand.getType() == CellType::Sand || sand.getType() == CellType::SandBlockingSpawn);
@@ -385,14 +612,6 @@ std::optional<Coordinate> Physics::simulate(Cave::CellRef cellToSimulate) {
             throw CppErrorCodeState;
         }
 
-#ifdef DEBUG
-        if (change) {
-            history.add(*change);
-        } else {
-            history.add("NO MORE ITERATIVE CHANGES");
-        }
-#endif
-
         // ==================
         // EXECUTE THE CHANGE
         // ==================
@@ -404,34 +623,33 @@ std::optional<Coordinate> Physics::simulate(Cave::CellRef cellToSimulate) {
             // We must be careful to update the reference to the active
             // cell when it may become invalid.
 
-            assert(change->cell->getType() == CellType::Sand ||
-                   change->cell->getType() == CellType::SandBlockingSpawn);
+            assert(change->cell.getType() == CellType::Sand ||
+                   change->cell.getType() == CellType::SandBlockingSpawn);
 
             std::visit(overloaded {
                 [&] (LeaveSpawn& action) {
-                    change->cell->setType(CellType::Spawn);
+                    this->trace.record(grain, TraceAction::LeaveSpawn, coordinate, action.target);
+                    change->cell.setType(CellType::Spawn);
                     active = cave.insertCell({ CellType::Sand, action.target });
                 },
                 [&] (Fall& action) {
+                    this->trace.record(grain, TraceAction::Fall, coordinate, action.target);
                     assert(this->cave.isEmpty(action.target));
-                    Cell moving = std::move(*change->cell);
-                    moving.setCoordinate(action.target);
-                    this->cave.removeCell(change->cell);
-                    active = this->cave.insertCell(std::move(moving));
+                    active = this->cave.relocate(change->cell, action.target);
                 },
                 [&] (Slide& action) {
+                    this->trace.record(grain, TraceAction::Slide, coordinate, action.target);
                     assert(this->cave.isEmpty(action.target));
-                    Cell moving = std::move(*change->cell);
-                    moving.setCoordinate(action.target);
-                    this->cave.removeCell(change->cell);
-                    active = this->cave.insertCell(std::move(moving));
+                    active = this->cave.relocate(change->cell, action.target);
                 },
                 [&] (Rest&) {
+                    this->trace.record(grain, TraceAction::Rest, coordinate, coordinate);
                     quitSimulation();
                 },
                 [&] (Destroy&) {
-                    if (change->cell->getType() == CellType::SandBlockingSpawn) {
-                        change->cell->setType(CellType::Spawn);
+                    this->trace.record(grain, TraceAction::Destroy, coordinate, coordinate);
+                    if (change->cell.getType() == CellType::SandBlockingSpawn) {
+                        change->cell.setType(CellType::Spawn);
                     } else {
                         this->cave.removeCell(change->cell);
                     }
@@ -448,22 +666,208 @@ std::optional<Coordinate> Physics::simulate(Cave::CellRef cellToSimulate) {
     }
 
     // Produce the coordinate of the resting sand cell.
+    this->printTrace(grain);
     if (active) {
-        auto& cell = **active;
-        history.add("SIMULATION RESULT:[" + cell + ']');
-        history.print();
-        return cell.getCoordinate();
+        return active->getCoordinate();
     } else {
-        history.add("SIMULATION RESULT:[NO ACTIVE CELL]");
-        history.print();
         return std::nullopt;
     }
 }
 
+std::optional<Coordinate> Physics::simulateResumingPath(Coordinate spawnPoint) {
+    auto grain = this->grains++;
+    auto const& spawnPoints = this->cave.getSpawnPoints();
+    auto& trajectory = this->trajectories[std::find(spawnPoints.begin(), spawnPoints.end(), spawnPoint) - spawnPoints.begin()];
+
+    // Everything on the path of the previous grain is still vacant,
+    // except for the positions sand has come to rest at since.  Step
+    // back to the deepest position the new grain would pass through.
+    while (!trajectory.empty() && !this->isVacant(trajectory.back())) {
+        trajectory.pop_back();
+    }
+    if (trajectory.empty()) {
+        assert(this->isVacant(spawnPoint));
+        trajectory.push_back(spawnPoint);
+        this->trace.record(grain, TraceAction::Spawn, spawnPoint, spawnPoint);
+    } else {
+        this->trace.record(grain, TraceAction::Resume, spawnPoint, trajectory.back());
+    }
+
+    while (true) {
+        auto coordinate = trajectory.back();
+
+        if (auto floor = this->cave.getHorizontalFloor();
+            floor && coordinate.y == *floor - 1) {
+            // The sand hit the floor, coming to rest.
+            break;
+        } else if (this->isVacant(coordinate.below())) {
+            if (!floor && !this->cave.findObjectBelow(coordinate)) {
+                // Sand has fallen through the bottom of the cave.
+                this->trace.record(grain, TraceAction::Destroy, coordinate, coordinate);
+                this->printTrace(grain);
+                return std::nullopt;
+            }
+            this->trace.record(grain, TraceAction::Fall, coordinate, coordinate.below());
+            trajectory.push_back(coordinate.below());
+        } else if (this->isVacant(coordinate.belowLeft())) {
+            this->trace.record(grain, TraceAction::Slide, coordinate, coordinate.belowLeft());
+            trajectory.push_back(coordinate.belowLeft());
+        } else if (this->isVacant(coordinate.belowRight())) {
+            this->trace.record(grain, TraceAction::Slide, coordinate, coordinate.belowRight());
+            trajectory.push_back(coordinate.belowRight());
+        } else {
+            break;
+        }
+    }
+
+    auto restingCoordinate = trajectory.back();
+    if (restingCoordinate == spawnPoint) {
+        this->cave.spawnSand(spawnPoint);
+    } else {
+        this->cave.insertCell({ CellType::Sand, restingCoordinate });
+    }
+    this->trace.record(grain, TraceAction::Rest, restingCoordinate, restingCoordinate);
+
+    this->assertValidity();
+    this->printTrace(grain);
+    return restingCoordinate;
+}
+
+std::optional<Coordinate> Physics::simulatePipelined() {
+    while (true) {
+        if (!this->pipeline.empty()) {
+            auto& oldest = this->pipeline.front();
+            if (oldest.state == GrainInFlight::State::Destroyed) {
+                for (auto const& record : oldest.steps) {
+                    this->trace.record(record);
+                }
+                this->printTrace(oldest.grain);
+
+                // The grains behind would never have been spawned.
+                this->pipeline.clear();
+                return std::nullopt;
+            } else if (oldest.state == GrainInFlight::State::Resting) {
+                auto restingCoordinate = oldest.position;
+                if (this->cave.isSpawnPoint(restingCoordinate)) {
+                    this->cave.spawnSand(restingCoordinate);
+                } else {
+                    this->cave.insertCell({ CellType::Sand, restingCoordinate });
+                }
+                for (auto const& record : oldest.steps) {
+                    this->trace.record(record);
+                }
+                this->trace.record(oldest.grain, TraceAction::Rest, restingCoordinate, restingCoordinate);
+                this->printTrace(oldest.grain);
+                this->pipeline.pop_front();
+
+                this->assertValidity();
+                return restingCoordinate;
+            } else {
+                // Keep it falling.
+            }
+        }
+
+        // A new grain looks at the row below the spawn points, so the
+        // grain before it has to be below that.  A grain coming to rest
+        // at a spawn point is then always in the cave by the time the
+        // next spawn point is picked.
+        if (this->pipeline.size() < MAX_GRAINS_IN_FLIGHT &&
+            (this->pipeline.empty() || this->pipeline.back().position.y >= SPAWN_POINT.y + 2) &&
+            !this->cave.isSpawnBlocked()) {
+            auto spawnPoint = this->cave.nextSpawnPoint();
+            auto grain = this->grains++;
+            auto& spawned = this->pipeline.emplace_back(GrainInFlight {
+                grain, spawnPoint, GrainInFlight::State::Falling, {},
+            });
+            spawned.steps.push_back({
+                grain, TraceAction::Spawn, spawnPoint.x, spawnPoint.y, spawnPoint.x, spawnPoint.y,
+            });
+        }
+
+        std::optional<int> rowOfGrainBefore = std::nullopt;
+        for (size_t index = 0; index < this->pipeline.size(); ++index) {
+            auto& grain = this->pipeline[index];
+            if (grain.state == GrainInFlight::State::Falling) {
+                this->step(grain, index == 0, rowOfGrainBefore);
+            }
+            rowOfGrainBefore = grain.position.y;
+        }
+    }
+}
+
+/// Moves a grain in flight down by a row, if it can do so without
+/// getting closer than two rows to the grain before it.
+void Physics::step(GrainInFlight& grain, bool isOldest, std::optional<int> rowOfGrainBefore) const {
+    auto coordinate = grain.position;
+    if (rowOfGrainBefore && coordinate.y + 2 >= *rowOfGrainBefore) {
+        // Wait for the grain before to get out of the way.
+        return;
+    }
+
+    if (auto floor = this->cave.getHorizontalFloor();
+        floor && coordinate.y == *floor - 1) {
+        // The sand hit the floor, coming to rest.
+        grain.state = GrainInFlight::State::Resting;
+    } else if (this->isVacant(coordinate.below())) {
+        // Whether there is anything below depends on where the grains
+        // before come to rest, so only the oldest grain can tell.
+        if (isOldest && !floor && !this->cave.findObjectBelow(coordinate)) {
+            // Sand has fallen through the bottom of the cave.
+            grain.steps.push_back({
+                grain.grain, TraceAction::Destroy, coordinate.x, coordinate.y, coordinate.x, coordinate.y,
+            });
+            grain.state = GrainInFlight::State::Destroyed;
+            return;
+        }
+        grain.position = coordinate.below();
+        grain.steps.push_back({
+            grain.grain, TraceAction::Fall, coordinate.x, coordinate.y, grain.position.x, grain.position.y,
+        });
+    } else if (this->isVacant(coordinate.belowLeft())) {
+        grain.position = coordinate.belowLeft();
+        grain.steps.push_back({
+            grain.grain, TraceAction::Slide, coordinate.x, coordinate.y, grain.position.x, grain.position.y,
+        });
+    } else if (this->isVacant(coordinate.belowRight())) {
+        grain.position = coordinate.belowRight();
+        grain.steps.push_back({
+            grain.grain, TraceAction::Slide, coordinate.x, coordinate.y, grain.position.x, grain.position.y,
+        });
+    } else {
+        grain.state = GrainInFlight::State::Resting;
+    }
+}
+
+bool Physics::isVacant(Coordinate coordinate) const {
+    if (auto cell = this->cave.findCell(coordinate)) {
+        // The spawn point is vacant for as long as no sand is
+        // blocking it.
+        return cell->getType() == CellType::Spawn;
+    } else {
+        return true;
+    }
+}
+
+/// Prints the steps of the grain in DEBUG build mode.
+void Physics::printTrace([[maybe_unused]] uint32_t grain) const {
+#ifdef DEBUG
+    // The regions of a cave may be simulated on several threads.
+    static std::mutex mutex;
+    std::lock_guard lock { mutex };
+    std::ios_base::sync_with_stdio(false);
+    for (auto const& record : this->trace.listRecords(grain)) {
+        std::cerr << Trace::describe(record) << '\n';
+    }
+    std::cerr << std::flush;
+    std::ios_base::sync_with_stdio(true);
+#endif
+}
+
 void Physics::assertValidity() const {
 #ifdef DEBUG
-    // Validate there is only one spawn or sand blocking spawn cell.
-    int count = 0;
+    // Validate there is a spawn or sand blocking spawn cell for each
+    // spawn point, and no others.
+    size_t count = 0;
     for (auto& cell : this->cave) {
         if (cell.getType() == CellType::Spawn || cell.getType() == CellType::SandBlockingSpawn) {
             ++count;
@@ -471,44 +875,18 @@ void Physics::assertValidity() const {
             // Keep counting.
         }
     }
-    assert(count == 1);
+    assert(count == this->cave.getSpawnPoints().size());
 
-    // Validate the columns are in the correct groups.
-    for (auto& bucket : this->cave.buckets) {
-        for (auto& cell : bucket.second) {
-            assert(cell.second.getCoordinate().x == bucket.first);
-            assert(cell.first == cell.second.getCoordinate().y);
-        }
-    }
+    std::visit([] (auto const& storage) {
+        storage.assertValidity();
+    }, this->cave.storage);
 #endif
 }
 
-bool Segment::isHorizontal() {
+bool Segment::isHorizontal() const {
     return coordinates.first.y == coordinates.second.y;
 }
 
-auto Segment::toCells() {
-    std::vector<Cell> cells;
-    if (isHorizontal()) {
-        // Add the horizontal cells
-        int minY = std::min(coordinates.first.y, coordinates.second.y);
-        int maxX = std::max(coordinates.first.x, coordinates.second.x);
-        int startX = std::min(coordinates.first.x, coordinates.second.x);
-        for (int x = startX; x <= maxX; ++x) {
-            cells.emplace_back(Cell { CellType::Wall, Coordinate { x, minY } });
-        }
-    } else {
-        // Add the vertical cells
-        int minX = std::min(coordinates.first.x, coordinates.second.x);
-        int maxY = std::max(coordinates.first.y, coordinates.second.y);
-        int startY = std::min(coordinates.first.y, coordinates.second.y);
-        for (int y = startY; y <= maxY; ++y) {
-            cells.emplace_back(Cell { CellType::Wall, Coordinate { minX, y } });
-        }
-    }
-    return cells;
-}
-
 int Segment::getMaxY() const {
     return std::max(this->coordinates.first.y, this->coordinates.second.y);
 }
@@ -534,17 +912,6 @@ std::vector<Segment> Segment::fromCoordinates(std::vector<Coordinate>&& coordina
     }
 }
 
-auto Wall::intoCells() {
-    auto cells { std::vector<Cell> {} };
-    for (auto& segment : this->segments) {
-        for (auto& cell : segment.toCells()) {
-            cells.emplace_back(cell);
-        }
-    }
-    this->segments = {};
-    return cells;
-}
-
 int Wall::getMaxY() const {
     auto const& segment = *std::max_element(std::begin(this->segments),
                                             std::end(this->segments),
@@ -554,38 +921,155 @@ int Wall::getMaxY() const {
     return segment.getMaxY();
 }
 
-Wall Wall::parse(std::string&& line) {
-    std::vector<Coordinate> coordinates;
-    std::istringstream sin { std::move(line) };
-    std::string maybeCoordinate;
-    while (sin >> maybeCoordinate) {
-        if (maybeCoordinate == "->") {
+std::variant<Wall, ParseError> Wall::parse(std::string_view input) {
+    // Every arrow ends a segment, and so may every line of a single
+    // coordinate.
+    size_t arrows = 0;
+    for (size_t index = 0; index + 1 < input.size(); ++index) {
+        arrows += input[index] == '-' && input[index + 1] == '>';
+    }
+    size_t lines = std::count(input.begin(), input.end(), '\n') + 1;
+    std::vector<Segment> segments;
+    segments.reserve(arrows + lines);
+
+    char const* begin = input.data();
+    char const* end = begin + input.size();
+    char const* position = begin;
+    auto failAt = [begin] (char const* position) {
+        return ParseError { static_cast<size_t>(position - begin) };
+    };
+    auto skipSpaces = [&position, end] () {
+        while (position != end && (*position == ' ' || *position == '\t' || *position == '\r')) {
+            ++position;
+        }
+    };
+
+    while (position != end) {
+        skipSpaces();
+        if (position == end) {
+            break;
+        } else if (*position == '\n') {
+            // A blank line.
+            ++position;
             continue;
-        } else {
-            std::istringstream coordinateIn(maybeCoordinate);
-            std::string xAsString, yAsString;
-            std::getline(coordinateIn, xAsString, ',');
-            std::getline(coordinateIn, yAsString, ',');
-            try {
-                int x = std::stoi(xAsString);
-                int y = std::stoi(yAsString);
-                coordinates.emplace_back(x, y);
-            } catch (std::invalid_argument) {
-                throw CppErrorCodeParse;
+        }
+
+        std::optional<Coordinate> previous;
+        size_t first = segments.size();
+        while (true) {
+            int x, y;
+            auto [afterX, errorOfX] = std::from_chars(position, end, x);
+            if (errorOfX != std::errc {}) {
+                return failAt(position);
+            } else if (afterX == end || *afterX != ',') {
+                return failAt(afterX);
             }
+            auto [afterY, errorOfY] = std::from_chars(afterX + 1, end, y);
+            if (errorOfY != std::errc {}) {
+                return failAt(afterX + 1);
+            }
+            position = afterY;
+
+            Coordinate coordinate { x, y };
+            if (previous) {
+                segments.emplace_back(std::make_pair(*previous, coordinate));
+            }
+            previous = coordinate;
+
+            skipSpaces();
+            if (position == end || *position == '\n') {
+                break;
+            } else if (end - position < 2 || position[0] != '-' || position[1] != '>') {
+                return failAt(position);
+            }
+            position += 2;
+            skipSpaces();
+        }
+
+        if (segments.size() == first) {
+            segments.emplace_back(std::make_pair(*previous, *previous));
+        }
+    }
+
+    return Wall { std::move(segments) };
+}
+
+RowsOfSand RowsOfSand::propagate(Wall const& walls, HorizontalFloor floor,
+                                 std::vector<Coordinate> const& spawnPoints) {
+    checkSpawnPoints(spawnPoints);
+    auto [left, right] = std::minmax_element(spawnPoints.begin(), spawnPoints.end(), [] (auto a, auto b) {
+        return a.x < b.x;
+    });
+
+    // The pile can't spread any further sideways than it is deep.
+    int depth = floor - SPAWN_POINT.y;
+    int width = right->x - left->x + 2 * depth + 1;
+    size_t words = (width + 63) / 64;
+    RowsOfSand sand { left->x - depth, SPAWN_POINT.y, words + 2, {} };
+    if (depth <= 0) {
+        return sand;
+    }
+    sand.rows.assign(depth * sand.stride, 0);
+
+    // Rasterise the walls into the same layout as the rows.
+    std::vector<uint64_t> wallRows(sand.rows.size(), 0);
+    for (auto const& segment : walls.segments) {
+        auto [from, to] = segment.coordinates;
+        for (int y = std::min(from.y, to.y); y <= std::max(from.y, to.y); ++y) {
+            for (int x = std::min(from.x, to.x); x <= std::max(from.x, to.x); ++x) {
+                int i = x - sand.x;
+                int j = y - sand.y;
+                if (i >= 0 && i < width && j >= 0 && j < depth) {
+                    wallRows[j * sand.stride + 1 + i / 64] |= uint64_t { 1 } << (i % 64);
+                }
+            }
+        }
+    }
+
+    for (auto spawnPoint : spawnPoints) {
+        int spawn = spawnPoint.x - sand.x;
+        sand.rows[1 + spawn / 64] |= (uint64_t { 1 } << (spawn % 64)) & ~wallRows[1 + spawn / 64];
+    }
+
+    for (int j = 1; j < depth; ++j) {
+        uint64_t const* above = &sand.rows[(j - 1) * sand.stride];
+        uint64_t const* walls = &wallRows[j * sand.stride];
+        uint64_t* row = &sand.rows[j * sand.stride];
+
+        // A plain loop over the words, which the compiler vectorises
+        // into shifts, ORs and ANDNOTs for both arm64 and x86_64.  The
+        // padding words supply the bits shifted in at either end.
+        for (size_t i = 1; i <= words; ++i) {
+            uint64_t spread = above[i] |
+                (above[i] << 1) | (above[i - 1] >> 63) |
+                (above[i] >> 1) | (above[i + 1] << 63);
+            row[i] = spread & ~walls[i];
         }
     }
-    return { Segment::fromCoordinates(std::move(coordinates)) };
+
+    return sand;
+}
+
+int RowsOfSand::count() const {
+    int count = 0;
+    for (auto word : this->rows) {
+        count += std::popcount(word);
+    }
+    return count;
 }
 
-auto Wall::parseFromLines(std::string&& input) {
-    std::vector<Wall> walls;
-    std::istringstream sin { std::move(input) };
-    std::string line;
-    while (std::getline(sin, line)) {
-        walls.push_back(Wall::parse(std::move(line)));
+std::vector<Coordinate> RowsOfSand::listCoordinates() const {
+    std::vector<Coordinate> coordinates;
+    coordinates.reserve(this->count());
+    for (size_t j = this->rows.size() / this->stride; j-- > 0;) {
+        for (size_t i = 1; i + 1 < this->stride; ++i) {
+            for (auto word = this->rows[j * this->stride + i]; word; word &= word - 1) {
+                int x = this->x + static_cast<int>((i - 1) * 64) + std::countr_zero(word);
+                coordinates.emplace_back(x, this->y + static_cast<int>(j));
+            }
+        }
     }
-    return walls;
+    return coordinates;
 }
 
 Delta::Delta(int checkpoint, Coordinate coordinate) {
@@ -595,218 +1079,1144 @@ Delta::Delta(int checkpoint, Coordinate coordinate) {
 }
 
 void Visualization::addSand(int x, int y) {
-    int i = x - this->bounds.x;
-    int j = y - this->bounds.y;
-    int index = j * (1 + this->bounds.width) + i;
+    int i = x - this->canvas.x;
+    int j = y - this->canvas.y;
+    size_t index = j * this->getStride() + i;
     this->data[index] = 'o';
 }
 
-bool Visualization::resizeFor(int x, int y) {
+bool Visualization::resizeFor(int x, int) {
     // Resize the visualization in the X axis.
-    if (x < this->bounds.x) {
-        // Insert an empty column.
-        std::ostringstream visualization {};
+    int left = this->bounds.x;
+    int right = this->bounds.x + this->bounds.width;
+    if (x >= left && x < right) {
+        return false;
+    }
+    left = std::min(left, x);
+    right = std::max(right, x + 1);
+
+    if (left < this->canvas.x || right > this->canvas.x + this->canvas.width) {
+        // Out of margin.  Grow the canvas by half of its width on the
+        // side that ran out.
+        int margin = std::max(8, this->canvas.width / 2);
+        Bounds canvas = this->canvas;
+        if (left < canvas.x) {
+            canvas.width += canvas.x - (left - margin);
+            canvas.x = left - margin;
+        }
+        if (right > canvas.x + canvas.width) {
+            canvas.width = right + margin - canvas.x;
+        }
+
+        size_t stride = static_cast<size_t>(canvas.width) + 1;
+        std::string data(stride * canvas.height, '.');
+        for (int j = 0; j < canvas.height; ++j) {
+            auto row = data.begin() + j * stride;
+            if (this->floor && j == canvas.height - 1) {
+                std::fill_n(row, canvas.width, '#');
+            }
+            std::copy_n(this->data.begin() + j * this->getStride(), this->canvas.width,
+                        row + (this->canvas.x - canvas.x));
+            row[canvas.width] = '\n';
+        }
+        this->canvas = canvas;
+        this->data = std::move(data);
+    }
+
+    this->bounds.x = left;
+    this->bounds.width = right - left;
+    return true;
+}
+
+void Visualization::removeSand(int x, int y, bool isSpawnPoint) {
+    int i = x - this->canvas.x;
+    int j = y - this->canvas.y;
+    size_t index = j * this->getStride() + i;
+    this->data[index] = isSpawnPoint ? '+' : '.';
+}
+
+void Visualization::showColumns(int x, int width) {
+    assert(x >= this->canvas.x && x + width <= this->canvas.x + this->canvas.width);
+    this->bounds.x = x;
+    this->bounds.width = width;
+}
+
+std::string Visualization::intoString() {
+    if (this->bounds.x == this->canvas.x && this->bounds.width == this->canvas.width) {
+        return std::move(this->data);
+    } else {
+        return this->toString();
+    }
+}
+
+std::string Visualization::toString() const {
+    if (this->bounds.x == this->canvas.x && this->bounds.width == this->canvas.width) {
+        return this->data;
+    }
+
+    // Cut the visible part out of each row of the canvas.
+    size_t stride = static_cast<size_t>(this->bounds.width) + 1;
+    std::string visible(stride * this->bounds.height, '\n');
+    for (int j = 0; j < this->bounds.height; ++j) {
+        std::copy_n(this->data.begin() + j * this->getStride() + (this->bounds.x - this->canvas.x),
+                    this->bounds.width, visible.begin() + j * stride);
+    }
+    return visible;
+}
+
+/// Appends the bytes of the value to the message, in the byte order of
+/// the machine.
+template <typename T>
+static void appendValue(std::string& message, T value) {
+    message.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+static void appendBounds(std::string& message, Bounds bounds) {
+    appendValue<int32_t>(message, bounds.x);
+    appendValue<int32_t>(message, bounds.y);
+    appendValue<int32_t>(message, bounds.width);
+    appendValue<int32_t>(message, bounds.height);
+}
+
+/// The cells of a frame, by their 2-bit codes in an EncodedFrame.
+static constexpr std::array<char, 4> CELLS_OF_CODES = { '.', '#', 'o', '+' };
+
+static uint8_t encodeCell(char cell) {
+    switch (cell) {
+        case '#':
+            return 1;
+
+        case 'o':
+            return 2;
+
+        case '+':
+            return 3;
+
+        default:
+            return 0;
+    }
+}
+
+EncodedFrame Visualization::encode() const {
+    size_t width = static_cast<size_t>(std::max(0, this->bounds.width));
+    size_t count = width * std::max(0, this->bounds.height);
+    size_t offset = this->bounds.x - this->canvas.x;
+    auto cellAt = [this, width, offset] (size_t k) {
+        return this->data[(k / width) * this->getStride() + offset + k % width];
+    };
+
+    std::string bytes {};
+    size_t k = 0;
+    while (k < count) {
+        char cell = cellAt(k);
+        if (cell == '.' || cell == 'o') {
+            // Most of a frame is runs of empty cells, or of sand.
+            size_t limit = cell == '.' ? 0x80 : 0x40;
+            size_t run = 1;
+            while (run < limit && k + run < count && cellAt(k + run) == cell) {
+                ++run;
+            }
+            if (run >= 3) {
+                bytes += static_cast<char>((cell == '.' ? 0x80 : 0x40) | (run - 1));
+                k += run;
+                continue;
+            }
+        }
+
+        uint8_t byte = 0;
+        for (size_t i = k; i < k + 3; ++i) {
+            byte = static_cast<uint8_t>(byte << 2) | (i < count ? encodeCell(cellAt(i)) : 0);
+        }
+        bytes += static_cast<char>(byte);
+        k += 3;
+    }
+    return EncodedFrame { this->bounds, this->floor, std::move(bytes) };
+}
+
+Visualization EncodedFrameView::decode() const {
+    size_t width = static_cast<size_t>(std::max(0, this->bounds.width));
+    size_t stride = width + 1;
+    size_t count = width * std::max(0, this->bounds.height);
+    std::string data(stride * std::max(0, this->bounds.height), '.');
+    for (size_t i = width; i < data.size(); i += stride) {
+        data[i] = '\n';
     }
-    return false;
-}
 
-Checkpoint::Checkpoint(Cave const& cave) {
+    size_t k = 0;
+    auto put = [&data, width, stride, count, &k] (char cell) {
+        if (k < count) {
+            data[(k / width) * stride + k % width] = cell;
+        }
+        ++k;
+    };
+    for (char c : this->bytes) {
+        auto byte = static_cast<uint8_t>(c);
+        if (byte & 0x80) {
+            k += (byte & 0x7F) + 1;
+        } else if (byte & 0x40) {
+            for (int i = 0; i <= (byte & 0x3F); ++i) {
+                put('o');
+            }
+        } else {
+            put(CELLS_OF_CODES[(byte >> 4) & 3]);
+            put(CELLS_OF_CODES[(byte >> 2) & 3]);
+            put(CELLS_OF_CODES[byte & 3]);
+        }
+    }
+    return Visualization { this->bounds, std::move(data), this->floor };
+}
+
+char EncodedFrameView::findCell(int x, int y) const {
+    if (!this->bounds.includes(x, y)) {
+        return '.';
+    }
+
+    size_t target = static_cast<size_t>(y - this->bounds.y) * this->bounds.width + (x - this->bounds.x);
+    size_t k = 0;
+    for (char c : this->bytes) {
+        auto byte = static_cast<uint8_t>(c);
+        if (byte & 0x80) {
+            k += (byte & 0x7F) + 1;
+            if (target < k) {
+                return '.';
+            }
+        } else if (byte & 0x40) {
+            k += (byte & 0x3F) + 1;
+            if (target < k) {
+                return 'o';
+            }
+        } else {
+            for (int shift : { 4, 2, 0 }) {
+                if (k++ == target) {
+                    return CELLS_OF_CODES[(byte >> shift) & 3];
+                }
+            }
+        }
+    }
+    return '.';
+}
+
+std::string EncodedFrameView::toMessage() const {
+    std::string message {};
+    message.reserve(4 * sizeof(int32_t) + this->bytes.size());
+    appendBounds(message, this->bounds);
+    message += this->bytes;
+    return message;
+}
+
+std::optional<std::string> Visualization::encodeChangesFrom(Visualization const& base) const {
+    if (base.bounds.y != this->bounds.y || base.bounds.height != this->bounds.height) {
+        // Only the width of the cave ever changes.
+        return std::nullopt;
+    }
+
+    // A full frame is one byte per cell, and a change five.
+    size_t limit = static_cast<size_t>(this->bounds.width + 1) * this->bounds.height;
+    std::string message {};
+    appendBounds(message, this->bounds);
+    auto countOffset = message.size();
+    appendValue<uint32_t>(message, 0);
+
+    uint32_t count = 0;
+    for (int j = 0; j < this->bounds.height; ++j) {
+        auto row = this->data.data() + j * this->getStride();
+        auto baseRow = base.data.data() + j * base.getStride();
+        for (int x = this->bounds.x; x < this->bounds.x + this->bounds.width; ++x) {
+            char cell = row[x - this->canvas.x];
+            bool known = x >= base.bounds.x && x < base.bounds.x + base.bounds.width;
+            if (known && cell == baseRow[x - base.canvas.x]) {
+                continue;
+            }
+            if (message.size() + 5 > limit) {
+                return std::nullopt;
+            }
+            appendValue<uint32_t>(message, static_cast<uint32_t>(j * this->bounds.width + (x - this->bounds.x)));
+            message += cell;
+            ++count;
+        }
+    }
+    std::copy_n(reinterpret_cast<char const*>(&count), sizeof(count), message.begin() + countOffset);
+    return message;
+}
+
+static Visualization printVisualization(Cave const& cave) {
     PrintingPress printingPress;
     printingPress.load(cave);
     auto bounds = printingPress.getBounds();
-    auto visualization = printingPress.printCave();
-    this->visualization = { bounds, std::move(visualization) };
+    return { bounds, std::move(printingPress).printCave(), cave.hasHorizontalFloor() };
 }
 
-void Checkpoint::apply(Delta const& delta) {
-    if (this->visualization.includes(delta.x, delta.y)) {
-        this->visualization.addSand(delta.x, delta.y);
+Checkpoint::Checkpoint(Cave const& cave): frame(printVisualization(cave).encode()) {}
+
+static void applyDelta(Visualization& visualization, Delta const& delta) {
+    if (visualization.includesRow(delta.y)) {
+        visualization.resizeFor(delta.x, delta.y);
+        visualization.addSand(delta.x, delta.y);
     } else {
-        // As the new sand cell is outside the bounds of the visualization,
+        // As the new sand cell is outside the rows of the visualization,
         // we are unable to represent this Delta.
         return;
     }
 }
 
+/// The size of a frame of the cave in the visualisation, in bytes.
+static size_t calculateFrameSize(Cave const& cave) {
+    auto bounds = cave.calculateBounds();
+    return (static_cast<size_t>(std::max(0, bounds.width)) + 1) * std::max(0, bounds.height);
+}
+
+void Recorder::recordCheckpoint(Cave const& cave) {
+    Checkpoint checkpoint { cave };
+    this->lastCheckpoint = this->count;
+    this->checkpointBounds = checkpoint.frame.getBounds();
+    this->deltas = 0;
+    this->memory += sizeof(Snapshot) + checkpoint.frame.size();
+    this->record(std::move(checkpoint), cave);
+}
+
+void Recorder::recordRest(Cave const& cave, Coordinate restingCoordinate) {
+    if (!this->checkpointBounds.includesRow(restingCoordinate.y)) {
+        // The visible height of the cave doesn't change, so this
+        // shouldn't happen.  A Checkpoint still shows the grain.
+        this->recordCheckpoint(cave);
+        return;
+    }
+
+    auto frameSize = calculateFrameSize(cave);
+    auto replayCost = frameSize + (this->deltas + 1) * RecordingBudget::DELTA_COST;
+    if (replayCost > this->budget.maxReplayCost &&
+        this->memory + sizeof(Snapshot) + frameSize <= this->budget.maxMemory) {
+        this->recordCheckpoint(cave);
+    } else {
+        ++this->deltas;
+        this->memory += sizeof(Snapshot);
+        this->record(Delta(this->lastCheckpoint, restingCoordinate), cave);
+    }
+}
+
+void Recorder::record(Snapshot&& snapshot, Cave const& cave) {
+    int index = this->count++;
+    this->publish(index, snapshot, cave);
+    if (this->archive) {
+        this->archive->append(snapshot);
+    } else {
+        this->snapshots.push_back(std::move(snapshot));
+    }
+}
+
+void Recorder::publish(int index, Snapshot const& snapshot, Cave const& cave) {
+    if (!this->stream) {
+        return;
+    }
+
+    if (this->streamBroken && std::holds_alternative<Delta>(snapshot)) {
+        // The subscribers missed a Delta, so they need a Checkpoint
+        // to catch up.  Only take one if it would get through.
+        if (this->stream->isFull()) {
+            return;
+        }
+        this->streamBroken = !this->stream->publish(index, Checkpoint(cave));
+    } else {
+        this->streamBroken = !this->stream->publish(index, snapshot);
+    }
+}
+
+LiveStream::LiveStream(zmq::context_t& context, std::string const& address, size_t capacity): queue(capacity) {
+    zmq::socket_t socket { context, zmq::socket_type::pub };
+    try {
+        socket.bind(address);
+    } catch (zmq::error_t const&) {
+        perror("LiveStream::LiveStream");
+        throw CppErrorCodeMsgq;
+    }
+    this->publisher = std::thread(&LiveStream::run, this, std::move(socket));
+}
+
+LiveStream::~LiveStream() {
+    this->done.store(true, std::memory_order_release);
+    this->publisher.join();
+}
+
+bool LiveStream::publish(int index, Snapshot snapshot) {
+    return this->queue.tryPush({ index, std::move(snapshot) });
+}
+
+void LiveStream::run(zmq::socket_t socket) {
+    while (true) {
+        // Everything pushed before the stream was done is in the queue
+        // by the time it is seen to be done.
+        bool finished = this->done.load(std::memory_order_acquire);
+        auto record = this->queue.tryPop();
+        if (!record) {
+            if (finished) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        std::vector<zmq::message_t> message {};
+        std::visit(overloaded {
+            [&message] (Checkpoint const& checkpoint) {
+                message.emplace_back(std::string_view{ "CHECKPOINT" });
+                message.emplace_back(checkpoint.frame.toMessage());
+            },
+            [&message] (Delta const& delta) {
+                message.emplace_back(std::string_view{ "DELTA" });
+                message.emplace_back(std::to_string(delta.x));
+                message.emplace_back(std::to_string(delta.y));
+            },
+        }, record->snapshot);
+        message.insert(message.begin() + 1, zmq::message_t { std::to_string(record->index) });
+
+        try {
+            // A PUB socket drops the message rather than wait for a
+            // slow subscriber.
+            zmq::send_multipart(socket, std::move(message));
+        } catch (zmq::error_t const&) {
+            perror("LiveStream::run");
+        }
+    }
+}
+
 std::string loadSnapshot(std::vector<Snapshot> const& snapshots, int index) {
     return std::visit(overloaded {
         [] (Checkpoint const& checkpoint) {
-            return checkpoint.visualization.toString();
+            return checkpoint.decode().intoString();
         },
-        [snapshots, index] (Delta const& delta) {
-            auto snapshot = std::get<Checkpoint>(snapshots[delta.checkpoint]);
+        [&snapshots, index] (Delta const& delta) {
+            auto visualization = std::get<Checkpoint>(snapshots[delta.checkpoint]).decode();
             for (int i = delta.checkpoint + 1; i <= index; i++) {
-                snapshot.apply(std::get<Delta>(snapshots[i]));
+                applyDelta(visualization, std::get<Delta>(snapshots[i]));
             }
-            return snapshot.visualization.intoString();
+            return visualization.intoString();
         },
     }, snapshots[index]);
 }
 
-void handleZmqError(zmq::socket_t& socket, zmq::context_t& context)
+size_t FrameCache::size() const {
+    return std::visit(overloaded {
+        [] (std::vector<Snapshot> const* snapshots) {
+            return snapshots->size();
+        },
+        [] (SnapshotArchive const* archive) {
+            return archive->size();
+        },
+    }, this->snapshots);
+}
+
+std::string FrameCache::load(int index) {
+    return this->fetch(index).toString();
+}
+
+std::string FrameCache::loadEncoded(int index) {
+    auto snapshot = this->at(index);
+    if (auto frame = std::get_if<EncodedFrameView>(&snapshot)) {
+        // Already encoded.
+        return frame->toMessage();
+    }
+    return this->fetch(index).encode().toMessage();
+}
+
+std::optional<std::string> FrameCache::loadChanges(int base, int index) {
+    // Reconstructing the frame at the index touches the frame it starts
+    // from, and keeping it may then evict the base, so take a copy.
+    auto baseFrame = this->fetch(base);
+    return this->fetch(index).encodeChangesFrom(baseFrame);
+}
+
+std::vector<std::string> FrameCache::loadRange(int from, int to, int stride) {
+    assert(from <= to && stride > 0);
+    int last = from + (to - from) / stride * stride;
+
+    // Every frame is the one before it with one more snapshot applied,
+    // so one canvas goes through all of them.
+    auto visualization = this->reconstruct(from);
+    std::vector<std::string> frames {};
+    frames.reserve((last - from) / stride + 1);
+    frames.push_back(visualization.toString());
+    for (int i = from + 1; i <= last; ++i) {
+        std::visit(overloaded {
+            [&visualization] (EncodedFrameView const& frame) {
+                visualization = frame.decode();
+            },
+            [&visualization] (Delta const& delta) {
+                applyDelta(visualization, delta);
+            },
+        }, this->at(i));
+
+        if ((i - from) % stride == 0) {
+            frames.push_back(visualization.toString());
+        }
+    }
+
+    // The next range likely starts where this one ended.
+    auto cached = std::find_if(this->frames.begin(), this->frames.end(), [last] (Frame const& frame) {
+        return frame.index == last;
+    });
+    if (cached != this->frames.end()) {
+        cached->lastUse = ++this->clock;
+    } else {
+        this->keep(last, std::move(visualization));
+    }
+    return frames;
+}
+
+Visualization FrameCache::reconstruct(int index) {
+    int checkpoint = this->findCheckpointOf(index);
+
+    // Start from the nearest frame kept that is based on the same
+    // Checkpoint.  Other frames would have to go through the
+    // Checkpoint anyway.
+    Frame* nearest = nullptr;
+    int distance = index - checkpoint;
+    for (auto& frame : this->frames) {
+        if (this->findCheckpointOf(frame.index) == checkpoint && std::abs(frame.index - index) < distance) {
+            nearest = &frame;
+            distance = std::abs(frame.index - index);
+        }
+    }
+
+    if (nearest) {
+        nearest->lastUse = ++this->clock;
+    }
+
+    int from = nearest ? nearest->index : checkpoint;
+    auto visualization = nearest
+        ? nearest->visualization
+        : std::get<EncodedFrameView>(this->at(checkpoint)).decode();
+
+    if (from == index) {
+        return visualization;
+    } else if (from < index) {
+        for (int i = from + 1; i <= index; ++i) {
+            applyDelta(visualization, std::get<Delta>(this->at(i)));
+        }
+    } else {
+        // The sand comes to rest in empty space, or on a spawn point,
+        // which the Checkpoint still shows.
+        auto const& frame = std::get<EncodedFrameView>(this->at(checkpoint));
+        for (int i = from; i > index; --i) {
+            auto delta = std::get<Delta>(this->at(i));
+            if (visualization.includesRow(delta.y)) {
+                visualization.removeSand(delta.x, delta.y, frame.findCell(delta.x, delta.y) == '+');
+            }
+        }
+
+        // The frame may have widened since, so narrow it back down to
+        // the Checkpoint and the grains up to the frame.
+        auto bounds = std::get<EncodedFrameView>(this->at(checkpoint)).bounds;
+        int left = bounds.x, right = bounds.x + bounds.width;
+        for (int i = checkpoint + 1; i <= index; ++i) {
+            auto delta = std::get<Delta>(this->at(i));
+            if (visualization.includesRow(delta.y)) {
+                left = std::min(left, delta.x);
+                right = std::max(right, delta.x + 1);
+            }
+        }
+        visualization.showColumns(left, right - left);
+    }
+
+    return visualization;
+}
+
+Visualization const& FrameCache::fetch(int index) {
+    for (auto& frame : this->frames) {
+        if (frame.index == index) {
+            frame.lastUse = ++this->clock;
+            return frame.visualization;
+        }
+    }
+    return this->keep(index, this->reconstruct(index));
+}
+
+SnapshotView FrameCache::at(int index) const {
+    return std::visit(overloaded {
+        [index] (std::vector<Snapshot> const* snapshots) {
+            return std::visit(overloaded {
+                [] (Checkpoint const& checkpoint) -> SnapshotView {
+                    return checkpoint.frame.view();
+                },
+                [] (Delta const& delta) -> SnapshotView {
+                    return delta;
+                },
+            }, (*snapshots)[index]);
+        },
+        [index] (SnapshotArchive const* archive) {
+            return archive->at(index);
+        },
+    }, this->snapshots);
+}
+
+int FrameCache::findCheckpointOf(int index) const {
+    return std::visit(overloaded {
+        [index] (EncodedFrameView const&) {
+            return index;
+        },
+        [] (Delta const& delta) {
+            return delta.checkpoint;
+        },
+    }, this->at(index));
+}
+
+Visualization const& FrameCache::keep(int index, Visualization visualization) {
+    if (this->frames.size() < this->capacity) {
+        // The frames are reserved up front, so the references to them
+        // stay valid.
+        this->frames.push_back({ index, std::move(visualization), ++this->clock });
+        return this->frames.back().visualization;
+    } else {
+        auto leastRecent = std::min_element(this->frames.begin(), this->frames.end(), [] (Frame const& lhs, Frame const& rhs) {
+            return lhs.lastUse < rhs.lastUse;
+        });
+        *leastRecent = { index, std::move(visualization), ++this->clock };
+        return leastRecent->visualization;
+    }
+}
+
+/// The endpoint the workers of the service take their requests from.
+static const std::string WORKERS_ENDPOINT { "inproc://regolith-reservoir-workers" };
+
+/// The most frames a reply to GETRANGE may carry.  Longer ranges have to
+/// be requested in parts.
+static constexpr int MAX_FRAMES_PER_RANGE = 1024;
+
+void handleZmqError(zmq::socket_t& socket, zmq::context_t& context, std::string const& endpoint)
 {
     // Close the current socket
     socket.close();
 
-    // Wait for a short period of time before trying to reopen the socket
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-    // Reopen the socket
+    // Reopen the socket.  An inproc endpoint is there as long as the
+    // context is, so there is no point in waiting.
     zmq::socket_t new_socket { context, zmq::socket_type::rep };
+    new_socket.connect(endpoint);
     socket = std::move(new_socket);
 }
 
-void runServiceOfVisualisation(zmq::context_t&& context, std::string&& address, std::vector<Snapshot>&& snapshots)
+static std::vector<zmq::message_t> respond(std::vector<zmq::message_t> const& request, FrameCache& frames, size_t count)
 {
-    zmq::socket_t socket { context, zmq::socket_type::rep };
-    zmq::recv_result_t result {};
-    bool quit = false;
+    std::vector<zmq::message_t> response {};
+    auto command = request.empty() ? std::string_view {} : request.front().to_string_view();
+    // The steps of the requests are ints.
+    int frameCount = static_cast<int>(count);
+    if (command == "GET" && request.size() > 1) {
+        try {
+            // Extract step number from request
+            int requestedStep = std::stoi(request[1].to_string());
+
+            // Send back visualisation data for requested step
+            if (requestedStep >= 0 && requestedStep < frameCount) {
+                response.emplace_back(std::string_view{ "OK" });
+                response.emplace_back(frames.load(requestedStep));
+            } else {
+                // Requested step out of range, ignore and move on to next request
+                response.emplace_back(std::string_view{ "ERROR" });
+            }
+        } catch (std::invalid_argument&) {
+            // Invalid request format, ignore and move on to next request
+            response.emplace_back(std::string_view{ "ERROR" });
+        } catch (std::out_of_range&) {
+            // Invalid request format, ignore and move on to next request
+            response.emplace_back(std::string_view{ "ERROR" });
+        }
+    } else if (command == "GETDELTA" && (request.size() == 2 || request.size() == 3)) {
+        try {
+            // Extract step number, and the step the client has already
+            // got if any, from request
+            int requestedStep = std::stoi(request[1].to_string());
+            std::optional<int> lastStep = std::nullopt;
+            if (request.size() == 3) {
+                lastStep = std::stoi(request[2].to_string());
+            }
+
+            // Send back the changes since the last step, or the whole
+            // frame if there is no last step
+            if (requestedStep >= 0 && requestedStep < frameCount &&
+                (!lastStep || (*lastStep >= 0 && *lastStep < frameCount))) {
+                response.emplace_back(std::string_view{ "OK" });
+                if (auto changes = lastStep ? frames.loadChanges(*lastStep, requestedStep) : std::nullopt) {
+                    response.emplace_back(std::string_view{ "CHANGES" });
+                    response.emplace_back(*std::move(changes));
+                } else {
+                    response.emplace_back(std::string_view{ "FRAME" });
+                    response.emplace_back(frames.loadEncoded(requestedStep));
+                }
+            } else {
+                // Requested step out of range, ignore and move on to next request
+                response.emplace_back(std::string_view{ "ERROR" });
+            }
+        } catch (std::invalid_argument&) {
+            // Invalid request format, ignore and move on to next request
+            response.emplace_back(std::string_view{ "ERROR" });
+        } catch (std::out_of_range&) {
+            // Invalid request format, ignore and move on to next request
+            response.emplace_back(std::string_view{ "ERROR" });
+        }
+    } else if (command == "GETRANGE" && (request.size() == 3 || request.size() == 4)) {
+        try {
+            // Extract the steps, both inclusive, and every how many
+            // steps to send from request
+            int from = std::stoi(request[1].to_string());
+            int to = std::stoi(request[2].to_string());
+            int stride = request.size() == 4 ? std::stoi(request[3].to_string()) : 1;
+
+            // Send back visualisation data for every requested step
+            if (from >= 0 && from <= to && to < frameCount && stride > 0 &&
+                (to - from) / stride < MAX_FRAMES_PER_RANGE) {
+                response.emplace_back(std::string_view{ "OK" });
+                for (auto& frame : frames.loadRange(from, to, stride)) {
+                    response.emplace_back(std::move(frame));
+                }
+            } else {
+                // Requested steps out of range, ignore and move on to next request
+                response.emplace_back(std::string_view{ "ERROR" });
+            }
+        } catch (std::invalid_argument&) {
+            // Invalid request format, ignore and move on to next request
+            response.emplace_back(std::string_view{ "ERROR" });
+        } catch (std::out_of_range&) {
+            // Invalid request format, ignore and move on to next request
+            response.emplace_back(std::string_view{ "ERROR" });
+        }
+    } else {
+        // Unrecoginised command
+        response.emplace_back(std::string_view{ "ERROR" });
+    }
+    return response;
+}
 
+SnapshotSource ServiceOfVisualisation::Run::getSource() const {
+    if (this->archive) {
+        return &*this->archive;
+    }
+    return &this->snapshots;
+}
+
+ServiceOfVisualisation::ServiceOfVisualisation(std::string const& address, size_t workerCount):
+    workerCount(std::max<size_t>(1, workerCount)), run(std::make_shared<Run>()) {
+    // Bind here rather than on the thread of the front end, so that a
+    // taken address is an error of the caller.
+    zmq::socket_t frontend { this->context, zmq::socket_type::router };
+    zmq::socket_t backend { this->context, zmq::socket_type::dealer };
     try {
-        socket.bind(address);
-    } catch (zmq::error_t) {
-        perror("ServiceOfVisualisation::run");
+        frontend.bind(address);
+        backend.bind(WORKERS_ENDPOINT);
+    } catch (zmq::error_t const&) {
+        perror("ServiceOfVisualisation::ServiceOfVisualisation");
         throw CppErrorCodeMsgq;
     }
 
-    while (!quit) {
+    this->frontEnd = std::thread(&ServiceOfVisualisation::serve, this, std::move(frontend), std::move(backend));
+}
+
+ServiceOfVisualisation::~ServiceOfVisualisation() {
+    this->stop();
+}
+
+ServiceOfVisualisation& ServiceOfVisualisation::getDefault() {
+    // Never destroyed, so that its workers aren't joined while the
+    // statics go away at exit.  The process takes the sockets with it.
+    static auto service = new ServiceOfVisualisation {};
+    return *service;
+}
+
+void ServiceOfVisualisation::publish(std::vector<Snapshot>&& snapshots) {
+    auto run = std::make_shared<Run>();
+    run->snapshots = std::move(snapshots);
+    this->setRun(std::move(run));
+}
+
+void ServiceOfVisualisation::publishArchive(std::string const& path) {
+    auto run = std::make_shared<Run>();
+    run->archive.emplace(path);
+    this->setRun(std::move(run));
+}
+
+void ServiceOfVisualisation::clear() {
+    this->setRun(std::make_shared<Run>());
+}
+
+void ServiceOfVisualisation::stop() {
+    if (!this->frontEnd.joinable()) {
+        return;
+    }
+
+    // Every socket of the context gives up on what it is waiting for
+    // once the context shuts down.
+    this->context.shutdown();
+    this->frontEnd.join();
+}
+
+void ServiceOfVisualisation::setRun(std::shared_ptr<Run const> run) {
+    // The workers still building a frame of the last run keep it alive
+    // until they are done.
+    std::lock_guard<std::mutex> lock { this->mutex };
+    this->run = std::move(run);
+}
+
+std::shared_ptr<ServiceOfVisualisation::Run const> ServiceOfVisualisation::getRun() {
+    std::lock_guard<std::mutex> lock { this->mutex };
+    return this->run;
+}
+
+void ServiceOfVisualisation::serve(zmq::socket_t frontend, zmq::socket_t backend)
+{
+    // The front end passes the requests of every client on to the
+    // workers, and their replies back.  It answers STOP by itself.
+    std::vector<std::thread> workers {};
+    for (size_t i = 0; i < this->workerCount; ++i) {
+        workers.emplace_back(&ServiceOfVisualisation::runWorker, this);
+    }
+
+    while (true) {
+        try {
+            zmq::pollitem_t items[] = {
+                { frontend.handle(), 0, ZMQ_POLLIN, 0 },
+                { backend.handle(), 0, ZMQ_POLLIN, 0 },
+            };
+            zmq::poll(items, 2, std::chrono::milliseconds { -1 });
+
+            if (items[0].revents & ZMQ_POLLIN) {
+                std::vector<zmq::message_t> request {};
+                auto result = zmq::recv_multipart(frontend, std::back_inserter(request));
+                assert(result.has_value());
+
+                // The envelope of a request ends with an empty frame,
+                // and the command follows.
+                auto delimiter = std::find_if(request.begin(), request.end(), [] (zmq::message_t const& frame) {
+                    return frame.size() == 0;
+                });
+                if (delimiter != request.end() && std::next(delimiter) != request.end() &&
+                    std::next(delimiter)->to_string_view() == "STOP") {
+                    // The client is done with the run, but other clients
+                    // may not be, so the frames stay until the next run
+                    // replaces them.
+                    std::vector<zmq::message_t> response {};
+                    std::move(request.begin(), std::next(delimiter), std::back_inserter(response));
+                    response.emplace_back(std::string_view{ "OK" });
+                    result = zmq::send_multipart(frontend, std::move(response));
+                } else {
+                    result = zmq::send_multipart(backend, std::move(request));
+                }
+                assert(result.has_value());
+            }
+
+            if (items[1].revents & ZMQ_POLLIN) {
+                std::vector<zmq::message_t> reply {};
+                auto result = zmq::recv_multipart(backend, std::back_inserter(reply));
+                assert(result.has_value());
+                result = zmq::send_multipart(frontend, std::move(reply));
+                assert(result.has_value());
+            }
+        } catch (zmq::error_t const& error) {
+            if (error.num() == ETERM) {
+                // The service is stopping.
+                break;
+            }
+            // Drop the message, and keep serving the other clients.
+            perror("ServiceOfVisualisation::serve");
+        }
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ServiceOfVisualisation::runWorker()
+{
+    // Each worker builds frames with a cache of its own, from the
+    // snapshots they all share.  It moves on to the latest run as soon
+    // as a request comes in after it is published.
+    zmq::socket_t socket { this->context, zmq::socket_type::rep };
+    socket.connect(WORKERS_ENDPOINT);
+    std::shared_ptr<Run const> run {};
+    std::optional<FrameCache> frames {};
+
+    while (true) {
         try {
             std::vector<zmq::message_t> request {};
+            auto result = zmq::recv_multipart(socket, std::back_inserter(request));
+            assert(result.has_value());
+
+            if (auto latest = this->getRun(); latest != run) {
+                frames.reset();
+                run = std::move(latest);
+                frames.emplace(run->getSource());
+            }
 
-            // Wait for request
-            result = zmq::recv_multipart(socket, std::back_inserter(request));
+            result = zmq::send_multipart(socket, respond(request, *frames, frames->size()));
             assert(result.has_value());
+        } catch (zmq::error_t const& error) {
+            if (error.num() == ETERM) {
+                // The service is stopping.
+                return;
+            }
+            handleZmqError(socket, this->context, WORKERS_ENDPOINT);
+        }
+    }
+}
 
-            std::vector<zmq::message_t> response {};
-            auto command = request.front().to_string_view();
-            if (command == "STOP") {
-                quit = true;
-                response.emplace_back(std::string_view{ "OK" });
-            } else if (command == "GET") {
-                try {
-                    // Extract step number from request
-                    int requestedStep = std::stoi(request[1].to_string());
-
-                    // Send back visualisation data for requested step
-                    if (requestedStep >= 0 && requestedStep < snapshots.size()) {
-                        response.emplace_back(std::string_view{ "OK" });
-                        response.emplace_back(loadSnapshot(snapshots, requestedStep));
-                    } else {
-                        // Requested step out of range, ignore and move on to next request
-                        response.emplace_back(std::string_view{ "ERROR" });
-                    }
-                } catch (std::invalid_argument&) {
-                    // Invalid request format, ignore and move on to next request
-                    response.emplace_back(std::string_view{ "ERROR" });
-                } catch (std::out_of_range&) {
-                    // Invalid request format, ignore and move on to next request
-                    response.emplace_back(std::string_view{ "ERROR" });
-                }
+/// The service the frames of a run are published to.
+static ServiceOfVisualisation& getService(Options const& options) {
+    return options.service ? *options.service : ServiceOfVisualisation::getDefault();
+}
+
+/// Produces the answer to Part 2 from the rows of the pile of sand,
+/// without simulating the grains.
+static std::string runByRowPropagation(Wall const& walls, HorizontalFloor floor, bool enableVisualisation, Options const& options) {
+    auto sand = RowsOfSand::propagate(walls, floor, options.spawnPoints);
+
+    if (enableVisualisation) {
+        // There is no telling the order the grains come to rest in.
+        // The visualisation fills the pile one row at a time instead,
+        // starting from the floor.
+        auto& service = getService(options);
+        Cave cave { options.storage, options.spawnPoints, options.spawnPolicy };
+        Recorder recorder { options.recordingBudget };
+        std::optional<LiveStream> stream;
+        std::optional<ArchiveWriter> archive;
+        if (options.streamAddress) {
+            stream.emplace(service.getContext(), *options.streamAddress, options.streamCapacity);
+            recorder.setStream(&*stream);
+        }
+        if (options.archivePath) {
+            archive.emplace(*options.archivePath);
+            recorder.setArchive(&*archive);
+        }
+        cave.insertWall(walls);
+        cave.setFloor({ floor });
+        recorder.recordCheckpoint(cave);
+
+        for (auto coordinate : sand.listCoordinates()) {
+            if (cave.isSpawnPoint(coordinate)) {
+                cave.spawnSand(coordinate);
             } else {
-                // Unrecoginised command
-                response.emplace_back(std::string_view{ "ERROR" });
+                cave.insertCell({ CellType::Sand, coordinate });
             }
-            result = zmq::send_multipart(socket, std::move(response));
-            assert(result.has_value());
-        } catch (zmq::error_t) {
-            handleZmqError(socket, context);
+            recorder.recordRest(cave, coordinate);
+        }
+
+        stream.reset();
+        if (archive) {
+            archive->finish();
+            service.publishArchive(*options.archivePath);
+        } else {
+            service.publish(recorder.intoSnapshots());
         }
     }
+
+    return std::to_string(sand.count());
 }
 
-void ServiceOfVisualisation::start(zmq::context_t&& context) {
-    // Beware ServiceOfVisualisation object's lifetime isn't as long as
-    // that of the thread.
-    auto thread = std::thread(runServiceOfVisualisation, std::move(context), std::move(this->address), std::move(this->snapshots));
-    thread.detach();
+/// @brief Groups the spawn points into regions of the cave that the
+/// sand of the other regions can't reach.
+///
+/// The sand from a spawn point can't spread any further sideways than
+/// the floor is deep.  A grain looks a column to either side, so the
+/// spreads of two regions must leave a column between them.
+///
+/// @return The spawn points of each region, left to right.
+static std::vector<std::vector<Coordinate>> splitIntoRegions(std::vector<Coordinate> spawnPoints, HorizontalFloor floor) {
+    std::sort(spawnPoints.begin(), spawnPoints.end(), [] (auto a, auto b) {
+        return a.x < b.x;
+    });
+
+    int reach = floor - SPAWN_POINT.y;
+    std::vector<std::vector<Coordinate>> regions;
+    for (auto spawnPoint : spawnPoints) {
+        if (regions.empty() || regions.back().back().x + reach < spawnPoint.x - reach - 1) {
+            regions.emplace_back();
+        }
+        regions.back().push_back(spawnPoint);
+    }
+    return regions;
 }
 
+/// Simulates the sand in a cave of the given walls.
+///
+/// @return The number of grains of sand that came to rest.
 template<bool FLOOR>
-std::string run(std::string&& input, bool enableVisualisation) {
-    zmq::context_t context {};
-    Cave cave {};
-    Physics physics { cave };
-    std::vector<Snapshot> snapshots {};
+static int simulateCave(Wall const& walls, int maxY, bool enableVisualisation, Options const& options) {
+    Cave cave { options.storage, options.spawnPoints, options.spawnPolicy };
+    Physics physics { cave, options.tracePath.has_value() };
+    Recorder recorder { options.recordingBudget };
+    std::vector<Coordinate> restingCoordinates;
     int turn = 0;
-    int snapshotId = 0;
-    int lastCheckpoint = 0;
-    int maxY = 0;
 
-    {
-        auto walls = Wall::parseFromLines(std::move(input));
-        for (auto&& wall : walls) {
-            maxY = std::max(maxY, wall.getMaxY());
-            cave.insertObject(std::move(wall));
-        }
-    }
+    cave.insertWall(walls);
 
     if (FLOOR) {
-        cave.setFloor({ 2 + maxY });
+        int floor = 2 + maxY;
+        cave.setFloor({ floor });
+
+        // The pile of sand can't spread any further sideways than
+        // it is deep.
+        auto [left, right] = std::minmax_element(options.spawnPoints.begin(), options.spawnPoints.end(), [] (auto a, auto b) {
+            return a.x < b.x;
+        });
+        cave.reserve({ left->x - floor, SPAWN_POINT.y, right->x - left->x + 2 * floor + 1, floor - SPAWN_POINT.y + 1 });
     }
 
+    std::optional<LiveStream> stream;
+    std::optional<ArchiveWriter> archive;
     if (enableVisualisation) {
-        snapshots.emplace_back(Checkpoint(cave));
-        lastCheckpoint = snapshotId;
-        ++snapshotId;
+        if (options.streamAddress) {
+            stream.emplace(getService(options).getContext(), *options.streamAddress, options.streamCapacity);
+            recorder.setStream(&*stream);
+        }
+        if (options.archivePath) {
+            archive.emplace(*options.archivePath);
+            recorder.setArchive(&*archive);
+        }
+        recorder.recordCheckpoint(cave);
     }
 
-    while (true) {
-        std::optional<Coordinate> maybeRestingCoordinate;
-        if (auto spawnCell = cave.getSpawnCell();
-            spawnCell->getType() == CellType::SandBlockingSpawn) {
-            // Is spawn blocked? -- this is an exit condition in Part 2.
-            break;
-        } else {
-            maybeRestingCoordinate = physics.simulate(cave.spawnSand());
-        }
+    try {
+        while (true) {
+            std::optional<Coordinate> maybeRestingCoordinate;
+            if (cave.isSpawnBlocked()) {
+                // Is spawn blocked? -- this is an exit condition in Part 2.
+                break;
+            } else {
+                switch (options.strategy) {
+                    case Strategy::FromSpawn:
+                        maybeRestingCoordinate = physics.simulate(cave.spawnSand(cave.nextSpawnPoint()));
+                        break;
+
+                    case Strategy::ResumePath:
+                        maybeRestingCoordinate = physics.simulateResumingPath(cave.nextSpawnPoint());
+                        break;
+
+                    case Strategy::Pipelined:
+                        maybeRestingCoordinate = physics.simulatePipelined();
+                        break;
+
+                    case Strategy::RowPropagation:
+                        // Handled above without simulating the grains.
+                        throw CppErrorCodeLogic;
+                }
+            }
 
-        if (enableVisualisation) {
-            if (snapshotId % 100 == 0) {
-                lastCheckpoint = snapshotId;
-                snapshots.emplace_back(Checkpoint(cave));
-            } else if (auto restingCoordinate = maybeRestingCoordinate) {
-                if (std::get<Checkpoint>(snapshots[lastCheckpoint]).includes(*restingCoordinate)) {
-                    snapshots.emplace_back(Delta(lastCheckpoint, *restingCoordinate));
-                } else {
-                    // Visualization requires a resize.  Delta works
-                    // only when such resize isn't necessary.  So we
-                    // must use Checkpoint instead, which enables
-                    // resizes.
-                    lastCheckpoint = snapshotId;
-                    snapshots.emplace_back(Checkpoint(cave));
+            if (maybeRestingCoordinate) {
+                if (enableVisualisation) {
+                    // The grains in flight may have left the edges of
+                    // the cells.
+                    cave.refreshBounds();
+                    recorder.recordRest(cave, *maybeRestingCoordinate);
+                }
+                if (options.restingIndex) {
+                    restingCoordinates.push_back(*maybeRestingCoordinate);
                 }
+                ++turn;
             } else {
-                // No active cell means the sand cell didn't land anywhere
-                // in Part 1.
+                // No changes from the simulation turn is the exit
+                // condition for Part 1.
+                break;
             }
-            ++snapshotId;
+        }
+    } catch (...) {
+        // The trace is the most useful when something went wrong.
+        if (options.tracePath) {
+            physics.trace.dump(*options.tracePath);
+        }
+        throw;
+    }
+
+    if (options.tracePath) {
+        physics.trace.dump(*options.tracePath);
+    }
+
+    if (options.restingIndex) {
+        *options.restingIndex = RestingIndex { std::move(restingCoordinates) };
+    }
+
+    if (enableVisualisation) {
+        stream.reset();
+        if (archive) {
+            archive->finish();
+            getService(options).publishArchive(*options.archivePath);
         } else {
-            // Visualization not requested.
+            getService(options).publish(recorder.intoSnapshots());
         }
+    }
+
+    return turn;
+}
+
+template<bool FLOOR>
+std::string run(std::string&& input, bool enableVisualisation, Options const& options) {
+    auto parsed = Wall::parse(input);
+    if (auto error = std::get_if<ParseError>(&parsed)) {
+#ifdef DEBUG
+        std::cerr << "Parse error at byte " << error->offset << std::endl;
+#endif
+        throw CppErrorCodeParse;
+    }
+    auto const& walls = std::get<Wall>(parsed);
+    int maxY = walls.segments.empty() ? 0 : walls.getMaxY();
 
-        if (maybeRestingCoordinate) {
-            ++turn;
+    if (options.strategy == Strategy::RowPropagation) {
+        if (options.restingIndex) {
+            // The rows of the pile don't tell the order of the grains.
+            throw CppErrorCodeLogic;
+        }
+        if constexpr (FLOOR) {
+            return runByRowPropagation(walls, 2 + maxY, enableVisualisation, options);
         } else {
-            // No changes from the simulation turn is the exit
-            // condition for Part 1.
-            break;
+            // Without a floor, the sand doesn't fill everything
+            // it can reach.
+            throw CppErrorCodeLogic;
         }
     }
 
-    if (enableVisualisation) {
-        ServiceOfVisualisation service { "tcp://*:22143", std::move(snapshots) };
-        service.start(std::move(context));
+    if constexpr (FLOOR) {
+        // Without a floor, the run ends with the first grain to fall
+        // out of the cave, which depends on the order of the grains
+        // across the regions.
+        auto regions = splitIntoRegions(options.spawnPoints, 2 + maxY);
+        if (regions.size() > 1 && !enableVisualisation && !options.tracePath && !options.restingIndex) {
+            std::vector<int> turns(regions.size(), 0);
+            std::vector<std::exception_ptr> errors(regions.size());
+            std::vector<std::thread> threads;
+            threads.reserve(regions.size());
+            for (size_t index = 0; index < regions.size(); ++index) {
+                Options regionOptions = options;
+                regionOptions.spawnPoints = std::move(regions[index]);
+                threads.emplace_back([&walls, maxY, &turns, &errors, index, regionOptions = std::move(regionOptions)] {
+                    try {
+                        turns[index] = simulateCave<FLOOR>(walls, maxY, false, regionOptions);
+                    } catch (...) {
+                        errors[index] = std::current_exception();
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            for (auto const& error : errors) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+
+            int turn = 0;
+            for (auto regionTurn : turns) {
+                turn += regionTurn;
+            }
+            return std::to_string(turn);
+        }
     }
 
-    return std::to_string(turn);
+    return std::to_string(simulateCave<FLOOR>(walls, maxY, enableVisualisation, options));
 }
 
-std::string runPart1(std::string&& input, bool enableVisualisation) {
-    return run<false>(std::move(input), enableVisualisation);
+std::string runPart1(std::string&& input, bool enableVisualisation, Options options) {
+    return run<false>(std::move(input), enableVisualisation, options);
 }
 
-std::string runPart2(std::string&& input, bool enableVisualisation) {
-    return run<true>(std::move(input), enableVisualisation);
+std::string runPart2(std::string&& input, bool enableVisualisation, Options options) {
+    return run<true>(std::move(input), enableVisualisation, options);
 }
 
 }
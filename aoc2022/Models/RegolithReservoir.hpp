@@ -8,10 +8,22 @@
 #ifndef RegolithReservoir_hpp
 #define RegolithReservoir_hpp
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <variant>
@@ -67,9 +79,11 @@ struct Bounds {
     int height;
 
     bool includes(int x, int y) const;
+
+    bool includesRow(int y) const { return y >= this->y && y < this->y + this->height; }
 };
 
-enum class CellType {
+enum class CellType: char {
     Wall,
     Sand,
     Spawn,
@@ -113,13 +127,6 @@ struct Cell {
     }
 };
 
-inline std::string operator + (std::string lhs, Cell const& rhs) {
-    std::ostringstream out;
-    out << lhs;
-    out << "CELL[TYPE:" << rhs.getType() << "," << rhs.getCoordinate() << ']';
-    return out.str();
-}
-
 enum struct ActiveCellState {
     Falling,
     Sliding,
@@ -153,23 +160,438 @@ struct Floor: public std::variant<Oblivion, HorizontalFloor> {
     }
 };
 
+struct Segment {
+    std::pair<Coordinate, Coordinate> coordinates;
+
+    Segment(auto coordinates): coordinates(std::move(coordinates)) {}
+
+    bool isHorizontal() const;
+    bool isVertical() const { return !this->isHorizontal(); }
+    int getMaxY() const;
+    static std::vector<Segment> fromCoordinates(std::vector<Coordinate>&&);
+};
+
+/// The position of the first byte of the input that doesn't parse.
+struct ParseError {
+    size_t offset;
+};
+
+struct Wall {
+    std::vector<Segment> segments;
+
+    Wall(auto segments): segments(std::move(segments)) {}
+
+    int getMaxY() const;
+
+    /// @brief Parses the paths of the input, one for each line, into a
+    /// single wall.
+    ///
+    /// The input is scanned in place with <code>std::from_chars</code>,
+    /// and the segments go into a single buffer, sized up front from the
+    /// number of arrows and lines.  Nothing else is allocated.  A path
+    /// of a single coordinate is a segment from the coordinate to
+    /// itself, and blank lines are skipped.
+    ///
+    /// @return The wall, or the offset of the first byte of the input
+    ///         that isn't part of a path.
+    static std::variant<Wall, ParseError> parse(std::string_view input);
+};
+
+class Cave;
+
 struct CaveIterator {
     CaveIterator& operator++();
-    Cell const& operator*();
+    Cell const& operator*() const;
 
-    using Buckets = std::unordered_map<int, std::map<int, Cell>>;
-    std::optional<Ref<const Buckets>> buckets;
-    Buckets::const_iterator column;
-    Buckets::value_type::second_type::const_iterator cell;
+    std::optional<Ref<const Cave>> cave;
+    std::optional<Cell> cell;
 };
 
 bool operator==(CaveIterator const& lhs, CaveIterator const& rhs);
 
-class Cave {
+/// Selects the backend a <code>Cave</code> keeps its cells in.
+enum class Storage {
+    /// Ordered maps of cells, one for each column of the cave.
+    Buckets,
+
+    /// A flat occupancy bitmap sized to the bounds of the cave.
+    Grid,
+
+    /// Fixed-size bitmap tiles, allocated where the cave has cells.
+    Tiles,
+};
+
+/// @brief Selects which spawn point releases the next grain of sand.
+///
+/// A spawn point that is blocked by sand is skipped by either policy.
+enum class SpawnPolicy {
+    /// Takes turns between the spawn points, in the order they are
+    /// given.
+    RoundRobin,
+
+    /// Always releases from the first spawn point, in the order they
+    /// are given, that isn't blocked.
+    Priority,
+};
+
+/// A closed range of coordinates along one axis.
+struct Interval {
+    int from;
+    int to;
+
+    bool includes(int value) const { return value >= this->from && value <= this->to; }
+};
+
+/// @brief Stores the walls of a cave as runs of wall cells.
+///
+/// The walls become intervals of Y in each column they cover: a
+/// vertical segment one interval in its column, and a horizontal
+/// segment a single cell in each column it crosses.  The intervals of
+/// a column are kept sorted and merged, so finding the wall below a
+/// coordinate is a lookup of the column and a binary search.  The
+/// memory of the walls is in proportion to the number of vertical
+/// segments and the width of the horizontal ones, rather than the
+/// height of the walls.
+class WallIntervals {
+public:
+    void insert(Segment const& segment);
+    void erase(Coordinate);
+    bool includes(Coordinate) const;
+
+    /// Finds the wall cell after the coordinate, column by column and
+    /// top to bottom.
+    std::optional<Coordinate> next(std::optional<Coordinate> after) const;
+
+    /// Finds the first wall cell below the coordinate, if there is one
+    /// above the given row.
+    std::optional<Coordinate> findBelow(Coordinate, int before = std::numeric_limits<int>::max()) const;
+
+    Bounds calculateBounds() const;
+
+private:
+    std::map<int, std::vector<Interval>> columns;
+
+    std::optional<int> findRowInColumn(int x, int fromY, int before = std::numeric_limits<int>::max()) const;
+};
+
+/// @brief Indexes the rows of each column of a cave that hold sand.
+///
+/// Each column keeps a bitset of its occupied rows, from the topmost
+/// row the column has seen.  Finding the first grain below a
+/// coordinate is then a count of trailing zeros, 64 rows at a time,
+/// instead of a search through the cells of the column.  The walls
+/// aren't indexed here, so that they keep costing memory by segment
+/// rather than by length.
+class Skyline {
+public:
+    void insert(Coordinate);
+    void erase(Coordinate);
+    bool includes(Coordinate) const;
+    std::optional<Coordinate> findBelow(Coordinate) const;
+
+    /// Lays out the columns of the bounds up front, so that the sand
+    /// coming to rest inside them doesn't allocate.
+    void reserve(Bounds bounds);
+
+private:
+    struct Column {
+        /// The row of the first bit, a multiple of 64.
+        int top = 0;
+        std::vector<uint64_t> words;
+    };
+
+    std::unordered_map<int, Column> columns;
+};
+
+/// @brief Hands out memory for the nodes of the maps of a storage.
+///
+/// The nodes are carved out of chunks that double in size, up to a
+/// limit, and freed nodes are kept in a list for each size to be handed
+/// out again.  Nothing is given back until the pool goes away, so
+/// a storage that keeps its cells only allocates a logarithmic number
+/// of times.  Not thread-safe.
+class NodePool {
+public:
+    NodePool() = default;
+    NodePool(NodePool const&) = delete;
+    NodePool& operator=(NodePool const&) = delete;
+
+    void* allocate(size_t size);
+    void deallocate(void* node, size_t size);
+
+private:
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    static constexpr size_t MAX_CHUNK_SIZE = 1 << 20;
+
+    std::vector<std::unique_ptr<std::byte[]>> chunks;
+    std::byte* cursor = nullptr;
+    size_t remaining = 0;
+    size_t nextChunkSize = 4096;
+
+    /// The free nodes of each size.
+    std::vector<std::pair<size_t, FreeNode*>> freeNodes;
+
+    FreeNode*& findFreeNodes(size_t size);
+};
+
+/// An allocator of the nodes of a container from a <code>NodePool</code>.
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    NodePool* pool;
+
+    PoolAllocator(NodePool* pool): pool(pool) {}
+
+    template <typename U>
+    PoolAllocator(PoolAllocator<U> const& other): pool(other.pool) {}
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(this->pool->allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t count) {
+        this->pool->deallocate(pointer, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(PoolAllocator<U> const& other) const { return this->pool == other.pool; }
+};
+
+/// @brief Stores the cells of a cave in ordered maps, one per column.
+///
+/// Every storage backend offers the same set of operations, which
+/// <code>Cave</code> dispatches to.  Iteration goes through
+/// <code>next()</code>, which produces the cell after the given
+/// coordinate, or the first cell if there is no coordinate.  The
+/// cells come in an order that only depends on where they are: here
+/// column by column and top to bottom, merging the cells of the
+/// buckets with the walls.
+/// <code>move()</code> moves a cell to a vacant coordinate in place,
+/// without allocating, and throws if there is no cell to move.
+///
+/// A bucket is kept when its last cell moves away, so that sand
+/// going back and forth between columns doesn't allocate, and the
+/// nodes of the maps come from a <code>NodePool</code> of the storage.
+class BucketStorage {
+public:
+    using Bucket = std::map<int, Cell, std::less<int>, PoolAllocator<std::pair<int const, Cell>>>;
+    using Buckets = std::map<int, Bucket, std::less<int>, PoolAllocator<std::pair<int const, Bucket>>>;
+
+    BucketStorage() = default;
+    BucketStorage(BucketStorage&&) = default;
+
+    /// The nodes of the buckets belong to the pool, which goes away
+    /// first in a member-wise assignment.
+    BucketStorage& operator=(BucketStorage&&) = delete;
+
+    std::optional<CellType> find(Coordinate) const;
+    void insert(Cell&& cell);
+    void insertSegment(Segment const& segment);
+    void erase(Coordinate);
+    void move(Coordinate from, Coordinate to);
+    std::optional<Coordinate> findObjectBelow(Coordinate) const;
+    std::optional<Cell> next(std::optional<Coordinate> after) const;
+    Bounds calculateBounds() const;
+    void reserve(Bounds bounds);
+    void assertValidity() const;
+
+private:
+    /// Owns the nodes of the buckets, and stays in place when the
+    /// storage moves.
+    std::unique_ptr<NodePool> pool = std::make_unique<NodePool>();
+
+    /// The cells other than the walls.
+    Buckets buckets { Buckets::allocator_type { this->pool.get() } };
+
+    WallIntervals walls;
+
+    Bucket& findOrInsertBucket(int x);
+
+    /// The rows of the buckets, for the falling objects.
+    Skyline skyline;
+};
+
+/// @brief Stores the cells of a cave in a flat occupancy bitmap.
+///
+/// The bitmap is laid out column by column, so that a column of the
+/// cave is a contiguous run of 64-bit words.  Finding the object
+/// below a coordinate is then a count of trailing zeros.  A separate
+/// plane keeps the type of each occupied cell.  The storage grows
+/// with some slack whenever a cell lands outside of its bounds.
+class GridStorage {
 public:
-    using Buckets = std::unordered_map<int, std::map<int, Cell>>;
-    using IteratorToCell = Buckets::value_type::second_type::iterator;
+    std::optional<CellType> find(Coordinate) const;
+    void insert(Cell&& cell);
+    void insertSegment(Segment const& segment);
+    void erase(Coordinate);
+    void move(Coordinate from, Coordinate to);
+    std::optional<Coordinate> findObjectBelow(Coordinate) const;
+    std::optional<Cell> next(std::optional<Coordinate> after) const;
+    Bounds calculateBounds() const;
+    void reserve(Bounds bounds);
+    void assertValidity() const {}
 
+private:
+    /// The area of the cave the bitmap covers.
+    Bounds bounds { 0, 0, 0, 0 };
+
+    /// The number of words that make up a column of the bitmap.
+    size_t wordsPerColumn = 0;
+
+    /// The occupancy bitmap.  Bit Y of a column is set if there is
+    /// a cell at that row.
+    std::vector<uint64_t> occupancy;
+
+    /// The type of each cell, in the same column-major order.
+    std::vector<CellType> types;
+
+    size_t indexOf(Coordinate coordinate) const {
+        return static_cast<size_t>(coordinate.x - this->bounds.x) * this->bounds.height + (coordinate.y - this->bounds.y);
+    }
+    size_t wordOf(Coordinate coordinate) const {
+        return static_cast<size_t>(coordinate.x - this->bounds.x) * this->wordsPerColumn + (coordinate.y - this->bounds.y) / 64;
+    }
+    uint64_t bitOf(Coordinate coordinate) const {
+        return uint64_t { 1 } << ((coordinate.y - this->bounds.y) % 64);
+    }
+};
+
+/// @brief Stores the cells of a cave in 64x64 tiles allocated on demand.
+///
+/// Each tile is a small column-major occupancy bitmap like the one of
+/// <code>GridStorage</code>, with its own plane of cell types.  A small
+/// open-addressing hash maps the coordinate of a tile to the tile, and
+/// the tile last looked up on each thread is remembered, so that
+/// consecutive accesses near each other skip the hash altogether.  The
+/// memory is in proportion to the occupied area of the cave, however
+/// far apart its cells are.
+///
+/// Iteration goes tile by tile, with the tiles column by column and
+/// top to bottom, and the cells of each tile in the same order.  So a
+/// pass over the cave reads each tile once, from start to end.
+class TileStorage {
+public:
+    std::optional<CellType> find(Coordinate) const;
+    void insert(Cell&& cell);
+    void insertSegment(Segment const& segment);
+    void erase(Coordinate);
+    void move(Coordinate from, Coordinate to);
+    std::optional<Coordinate> findObjectBelow(Coordinate) const;
+    std::optional<Cell> next(std::optional<Coordinate> after) const;
+    Bounds calculateBounds() const;
+    void reserve(Bounds bounds);
+    void assertValidity() const;
+
+private:
+    static constexpr int TILE_SHIFT = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+
+    struct Tile {
+        /// The coordinate of the tile, in units of tiles.
+        int x;
+        int y;
+
+        /// Bit Y of a column is set if there is a cell at that row.
+        std::array<uint64_t, TILE_SIZE> columns {};
+
+        /// The type of each cell, column by column.
+        std::array<CellType, TILE_SIZE * TILE_SIZE> types {};
+    };
+
+    /// The index of the tile last looked up on the current thread.  It
+    /// is only a hint: the tile it points to is checked against the
+    /// coordinate before it is used, so it doesn't matter which
+    /// storage it came from.
+    static thread_local size_t lastTile;
+
+    /// The tiles, in the order they were allocated.
+    std::vector<Tile> tiles;
+
+    /// Indices of the tiles, sorted by the column and then the row of
+    /// the tile.
+    std::vector<uint32_t> order;
+
+    /// Indices of the tiles plus one, or zero for an empty slot.  The
+    /// number of slots is a power of two, at least twice the tiles.
+    std::vector<uint32_t> slots;
+
+    /// The range of rows of tiles that have tiles allocated.
+    int minTileY = std::numeric_limits<int>::max();
+    int maxTileY = std::numeric_limits<int>::min();
+
+    static int tileOf(int value) { return value >> TILE_SHIFT; }
+    static int offsetOf(int value) { return value & (TILE_SIZE - 1); }
+    static size_t typeIndexOf(Coordinate coordinate) {
+        return offsetOf(coordinate.x) * TILE_SIZE + offsetOf(coordinate.y);
+    }
+
+    Tile const* findTile(int tileX, int tileY) const;
+    std::vector<uint32_t>::const_iterator findInOrder(int tileX, int tileY) const;
+    Tile& obtainTile(int tileX, int tileY);
+    size_t slotOf(int tileX, int tileY) const;
+    void rehash(size_t slotCount);
+};
+
+/// @brief Keeps the bounds of the cells of a cave as they come and go.
+///
+/// Along with the bounds, it counts the cells on each of the four
+/// edges of the bounds.  Inserting a cell only ever grows the bounds,
+/// and removing one only shrinks them once an edge runs out of cells.
+/// Then the bounds shrink by an unknown amount, so they are marked
+/// stale until they are calculated from the cells again.
+class BoundsTracker {
+public:
+    /// Counts a cell at a coordinate that wasn't occupied.
+    void insert(Coordinate);
+
+    /// @brief Counts the cells of the walls, from the endpoints of their
+    /// segments.
+    ///
+    /// The segments may cross each other and the cells that are
+    /// already counted, which are only looked up on the edges the
+    /// bounds keep.
+    ///
+    /// @param isOccupied Tells whether there is a cell at a coordinate
+    /// before the walls.
+    void insert(Wall const& wall, std::function<bool(Coordinate)> const& isOccupied);
+
+    /// Stops counting a cell at a coordinate that was occupied.
+    void erase(Coordinate);
+
+    bool isOnEdge(Coordinate coordinate) const {
+        return !this->stale && !this->empty &&
+            (coordinate.x == this->left || coordinate.x == this->right ||
+             coordinate.y == this->top || coordinate.y == this->bottom);
+    }
+
+    bool isStale() const { return this->stale; }
+
+    /// @brief Starts counting again from the bounds of the cells.
+    ///
+    /// @param bounds The bounds of the cells, calculated from scratch.
+    /// @param isOccupied Tells whether there is a cell at a coordinate.
+    void reset(Bounds bounds, std::function<bool(Coordinate)> const& isOccupied);
+
+    Bounds getBounds() const;
+
+private:
+    int left = 0, right = -1, top = 0, bottom = -1;
+
+    /// The number of cells on each edge.
+    int leftCount = 0, rightCount = 0, topCount = 0, bottomCount = 0;
+
+    /// Whether there are no cells at all.
+    bool empty = true;
+
+    bool stale = false;
+};
+
+class Cave {
+public:
     /// @brief Represents the reference to a cell in the cave.
     ///
     /// <code>CellRef</code> points to a valid cell in the cave.  The
@@ -177,88 +599,229 @@ public:
     /// invalidate a <code>CellRef</code>.  In this case, accessing
     /// the <code>CellRef</code> to resolve a <code>Cell</code> will
     /// throw an exception.
-    struct CellRef {
-        IteratorToCell iteratorToCell;
-        CellRef(IteratorToCell iteratorToCell): iteratorToCell(iteratorToCell) {}
-        auto operator * () -> Cell& {
-            return this->iteratorToCell->second;
-        }
-        auto operator -> () -> Cell* {
-            return &this->iteratorToCell->second;
-        }
-        operator IteratorToCell () {
-            return this->iteratorToCell;
-        }
+    ///
+    /// A <code>CellRef</code> refers to the cell by its coordinate,
+    /// so it stays valid for as long as the cell doesn't move,
+    /// regardless of the storage backend of the cave.
+    class CellRef {
+        Ref<Cave> cave;
+        Coordinate coordinate;
+
+    public:
+        CellRef(Cave& cave, Coordinate coordinate): cave(cave), coordinate(coordinate) {}
+        Cell operator * () const;
+        Coordinate getCoordinate() const { return this->coordinate; }
+        CellType getType() const { return (**this).getType(); }
+        void setType(CellType type);
     };
 
-    Cave();
-
-    auto begin() const;
-    auto end() const;
-
-    template <typename T>
-    void insertObject(T&& object);
-    IteratorToCell insertCell(Cell&& cell);
+    /// @brief Constructs an empty cave with the given spawn points.
+    ///
+    /// The spawn points must all be on the row of
+    /// <code>SPAWN_POINT</code>, so that no grain of sand ever passes
+    /// through another spawn point.  Throws
+    /// <code>CppErrorCodeInput</code> if they aren't, if there are
+    /// none, or if any are the same.
+    Cave(Storage storage = Storage::Buckets,
+         std::vector<Coordinate> const& spawnPoints = { SPAWN_POINT },
+         SpawnPolicy spawnPolicy = SpawnPolicy::RoundRobin);
+
+    /// @brief Goes through the cells of the cave in a spatial order.
+    ///
+    /// The order only depends on where the cells are, never on how
+    /// they got there: column by column and top to bottom, except that
+    /// the tiles of <code>Storage::Tiles</code> are gone through one
+    /// after another in that order.
+    CaveIterator begin() const;
+    CaveIterator end() const;
+
+    void insertWall(Wall const& wall);
+    CellRef insertCell(Cell&& cell);
     void removeCell(Coordinate);
-    void removeCell(IteratorToCell);
-    IteratorToCell relocate(IteratorToCell, Coordinate to);
+    void removeCell(CellRef);
+    CellRef relocate(CellRef, Coordinate to);
+
+    /// @brief Prepares the storage for a cave of the given bounds.
+    ///
+    /// Cells may still be inserted outside of the bounds.  It only
+    /// saves the dense storage backends from growing one step at a
+    /// time.
+    void reserve(Bounds bounds);
 
     void setFloor(Floor floor) { this->floor = floor; }
     auto getHorizontalFloor() const { return this->floor.getHorizontalFloor(); }
     auto hasHorizontalFloor() const { return this->floor.isHorizontalFloor(); }
 
     std::optional<Coordinate> findObjectBelow(Coordinate) const;
-    std::optional<IteratorToCell> findCell(Coordinate);
+    std::optional<CellRef> findCell(Coordinate);
 
-    /// @brief Returns the spawn cell of the cave.
+    /// @brief Returns the cell of the first spawn point of the cave.
     ///
-    /// Returns the only spawn cell of the cave.  It is an error if
-    /// there is no spawn cell found in the cave.  The behaviour of
-    /// the function is undefined in this case.  In DEBUG build mode,
-    /// this causes an assertion failure.
+    /// It is an error if there is no spawn cell found in the cave.
+    /// The behaviour of the function is undefined in this case.  In
+    /// DEBUG build mode, this causes an assertion failure.
     ///
     /// @return The reference object to the spawn cell.
     CellRef getSpawnCell();
 
-    IteratorToCell spawnSand();
+    std::vector<Coordinate> const& getSpawnPoints() const { return this->spawnPoints; }
+    bool isSpawnPoint(Coordinate) const;
+
+    /// Whether sand is blocking every spawn point.
+    bool isSpawnBlocked() const;
+
+    /// @brief Picks the spawn point that releases the next grain of
+    /// sand, according to the spawn policy.
+    ///
+    /// Throws <code>CppErrorCodeState</code> if every spawn point is
+    /// blocked.
+    Coordinate nextSpawnPoint();
+
+    /// Spawns a new sand cell at the given spawn point, which must not
+    /// be blocked.
+    CellRef spawnSand(Coordinate spawnPoint = SPAWN_POINT);
 
     bool isWall(Coordinate) const;
     bool isEmpty(Coordinate) const;
+
+    /// @brief Calculates the bounds of the cells, and of the floor.
+    ///
+    /// Once cells are removed from an edge, the bounds are calculated
+    /// from all of the cells until <code>refreshBounds()</code> is
+    /// called.
     Bounds calculateBounds() const;
 
+    /// Counts the bounds of the cells again if removing cells left them
+    /// stale, so that they keep up with the cells from then on.
+    void refreshBounds();
+
 private:
-    Buckets buckets;
+    std::variant<BucketStorage, GridStorage, TileStorage> storage;
 
     /// Describes the floor of the cave.
     Floor floor;
 
-    friend class Physics;
-};
+    std::vector<Coordinate> spawnPoints;
+    SpawnPolicy spawnPolicy;
 
-enum class CellState {
-    Empty,
-    Sand,
-    Wall,
-    Spawn,
+    /// The spawn point whose turn is next in a round robin.
+    size_t nextSpawnIndex = 0;
+
+    /// The bounds of the cells, kept up to date as they change.
+    BoundsTracker bounds;
+
+    std::optional<Cell> next(std::optional<Coordinate> after) const;
+    bool isVacantSpawnPoint(Coordinate) const;
+
+    friend class Physics;
+    friend struct CaveIterator;
 };
 
+/// @brief Renders a cave in ASCII.
+///
+/// The cave is rasterised straight into a single buffer, row by row,
+/// with a new line character at the end of each row.  The buffer is
+/// filled with empty space up front, and each cell is then a single
+/// store of the character its type looks up to.
 class PrintingPress {
 public:
-    PrintingPress(): bounds(std::nullopt), grid({}) {}
+    PrintingPress(): bounds(std::nullopt), raster({}) {}
 
     Bounds getBounds() const { return this->bounds.value(); }
     void load(Cave const& cave);
-    std::string printCave() const;
+    std::string printCave() const & { return this->raster; }
+    std::string printCave() && { return std::move(this->raster); }
 
 private:
     std::optional<Bounds> bounds;
 
-    std::vector<std::vector<CellState>> grid;
+    std::string raster;
+};
+
+/// What happened to a grain of sand in a <code>TraceRecord</code>.
+enum class TraceAction: uint8_t {
+    Spawn,
+    LeaveSpawn,
+    Fall,
+    Slide,
+    Rest,
+    Destroy,
+
+    /// The grain picked up the path of the previous grain.
+    Resume,
+};
+
+/// A record of a single step of the simulation of a grain.  The
+/// coordinates are the same for the actions that don't move the grain.
+struct TraceRecord {
+    uint32_t grain;
+    TraceAction action;
+    int32_t fromX, fromY;
+    int32_t toX, toY;
+};
+
+/// @brief Records the last steps of the simulation in a ring buffer.
+///
+/// The trace keeps a fixed number of binary records, overwriting the
+/// oldest ones, so recording a step is a store into preallocated
+/// memory.  A trace of no capacity records nothing, and costs no
+/// memory.  The records can be written to a file with
+/// <code>dump()</code>, and read back as text with <code>decode()</code>.
+class Trace {
+public:
+    /// The number of records a trace that is on keeps by default.
+    static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
+
+    /// @param capacity The number of records kept, a power of two, or
+    ///        zero to record nothing.
+    explicit Trace(size_t capacity = 0);
+
+    void record(uint32_t grain, TraceAction action, Coordinate from, Coordinate to) {
+        this->record({ grain, action, from.x, from.y, to.x, to.y });
+    }
+
+    void record(TraceRecord const& record) {
+        if (this->records.empty()) {
+            return;
+        }
+        this->records[this->written & (this->records.size() - 1)] = record;
+        ++this->written;
+    }
+
+    /// Lists the records kept, oldest first.  Given a grain, only
+    /// lists the latest records of that grain.
+    std::vector<TraceRecord> listRecords(std::optional<uint32_t> grain = std::nullopt) const;
+
+    /// Writes the records kept to a binary file.
+    void dump(std::string const& path) const;
+
+    /// @brief Reads a file written by <code>dump()</code> as text.
+    ///
+    /// Throws <code>CppErrorCodeParse</code> if the file isn't a trace.
+    ///
+    /// @return One line for each record, oldest first.
+    static std::string decode(std::string const& path);
+
+    static std::string describe(TraceRecord const& record);
+
+private:
+    std::vector<TraceRecord> records;
+
+    /// The number of records ever written.
+    uint64_t written = 0;
 };
 
 struct Physics {
     Cave& cave;
 
+    /// The last steps of the simulation, if they are kept.
+    Trace trace {};
+
+    /// @param enableTrace Whether to keep the last steps of the
+    ///        simulation in <code>trace</code>.  They are always kept in
+    ///        DEBUG build mode, which prints them.
+    Physics(Cave& cave, bool enableTrace = false);
+
     /// @brief Simulates the give cell in the cave.
     ///
     /// <code>simulate()</code> simulates the given cell in the cave
@@ -273,56 +836,112 @@ struct Physics {
     ///         <code>std::nullopt</code>.
     std::optional<Coordinate> simulate(Cave::CellRef cellToSimulate);
 
+    /// @brief Drops a new grain of sand from the given spawn point,
+    /// resuming the trajectory of the previous grain from there.
+    ///
+    /// A grain of sand follows the same path as the previous grain
+    /// right up to the position where the previous grain came to rest.
+    /// <code>simulateResumingPath()</code> keeps that path, and only
+    /// simulates the new grain from the deepest position on the path
+    /// that is still vacant.  The grain doesn't appear in the cave
+    /// until it comes to rest.  The spawn point must not be blocked.
+    ///
+    /// Sand only ever fills a cell once every cell below it the grain
+    /// could move to is filled, so the cells of a path that other
+    /// spawn points have filled since are always at its end.
+    ///
+    /// @return The coordinate of the grain if it has come to rest.  If
+    ///         it has fallen out of the cave, returns
+    ///         <code>std::nullopt</code>.
+    std::optional<Coordinate> simulateResumingPath(Coordinate spawnPoint = SPAWN_POINT);
+
+    /// @brief Drops grains of sand from the spawn point several at a
+    /// time, and returns the next one to come to rest.
+    ///
+    /// Every grain moves down by exactly one row a step, so a grain
+    /// never comes to rest above the row it is in.  A grain only looks
+    /// at its own row and the row below it, so as long as it stays at
+    /// least two rows above the grain before it, nothing that grain
+    /// does can change where the later grain goes.  The grains in
+    /// flight step together, oldest first, each keeping that gap, and
+    /// come to rest in the order they were dropped.  The result is the
+    /// same as dropping one grain at a time.
+    ///
+    /// Only the oldest grain can fall out of the cave, since a later
+    /// grain could still land on the grains before it.  When it does,
+    /// the grains behind it are dropped, as they would never have been
+    /// spawned.  The steps of a grain are kept aside until it is done,
+    /// so the trace reads grain by grain as for the other strategies.
+    /// The spawn points take their turns as the grains are spawned.
+    /// The spawn points must not all be blocked.
+    ///
+    /// @return The coordinate of the next grain to come to rest.  If
+    ///         it has fallen out of the cave, returns
+    ///         <code>std::nullopt</code>.
+    std::optional<Coordinate> simulatePipelined();
+
 private:
-    void assertValidity() const;
-};
+    /// A grain of sand on its way down in <code>simulatePipelined()</code>.
+    struct GrainInFlight {
+        enum class State { Falling, Resting, Destroyed };
 
-using Event = std::string;
+        uint32_t grain;
+        Coordinate position;
+        State state;
 
-struct History {
-    std::vector<Event> events;
+        /// The steps of the grain, written to the trace once it is done.
+        std::vector<TraceRecord> steps;
+    };
 
-    History& add(Event event) {
-#ifdef DEBUG
-        events.push_back(event);
-#endif
-        return *this;
-    }
+    /// The most grains in flight at once.  The gap between the grains
+    /// already bounds it by half the depth of the cave.
+    static constexpr size_t MAX_GRAINS_IN_FLIGHT = 32;
 
-    void print() const {
-#ifdef DEBUG
-        std::ios_base::sync_with_stdio(false);
-        for (auto const& event : this->events) {
-            std::cerr << event << std::endl;
-        }
-        std::cerr << std::flush;
-        std::ios_base::sync_with_stdio(true);
-#endif
-    }
-};
+    /// The grains in flight, oldest first.
+    std::deque<GrainInFlight> pipeline {};
 
-struct Segment {
-    std::pair<Coordinate, Coordinate> coordinates;
+    /// The path of the previous grain of sand from each spawn point,
+    /// down to the position where it came to rest.
+    std::vector<std::vector<Coordinate>> trajectories;
 
-    Segment(auto coordinates): coordinates(coordinates) {}
+    /// The number of grains simulated, which identifies the next one.
+    uint32_t grains = 0;
 
-    bool isHorizontal();
-    bool isVertical() { return !this->isHorizontal(); }
-    auto toCells();
-    int getMaxY() const;
-    static std::vector<Segment> fromCoordinates(std::vector<Coordinate>&&);
+    bool isVacant(Coordinate) const;
+    void step(GrainInFlight& grain, bool isOldest, std::optional<int> rowOfGrainBefore) const;
+    void printTrace(uint32_t grain) const;
+    void assertValidity() const;
 };
 
-struct Wall {
-    std::vector<Segment> segments;
+/// @brief Represents the pile of sand on a horizontal floor, row by row.
+///
+/// With a horizontal floor, the sand at rest takes up exactly the
+/// cells that are reachable from the spawn point by moving down,
+/// down-left and down-right without passing through a wall.  So each
+/// row of the pile is the row above it spread by a cell to each side,
+/// less the walls in the row.  The rows are bitmaps of 64-bit words,
+/// padded with an empty word on each side.
+struct RowsOfSand {
+    /// The X coordinate of the first bit in a row.
+    int x;
 
-    Wall(auto segments): segments(segments) {}
+    /// The Y coordinate of the first row.
+    int y;
 
-    auto intoCells();
-    int getMaxY() const;
+    /// The number of words in a row, including the padding.
+    size_t stride;
+
+    std::vector<uint64_t> rows;
+
+    /// Propagates the sand from the spawn points down to the floor.
+    static RowsOfSand propagate(Wall const& walls, HorizontalFloor floor,
+                                std::vector<Coordinate> const& spawnPoints = { SPAWN_POINT });
 
-    static Wall parse(std::string&& line);
-    static auto parseFromLines(std::string&& input);
+    /// Counts the grains of sand in the pile.
+    int count() const;
+
+    /// Lists the coordinates of the grains, bottom row first.
+    std::vector<Coordinate> listCoordinates() const;
 };
 
 /// Represents a snapshot that is a delta from the previous snapshot.
@@ -337,28 +956,57 @@ struct Delta {
     Delta(int checkpoint, Coordinate);
 };
 
+class EncodedFrame;
+
 /// @brief Represents the state of the cave in ASCII.
 ///
 /// Represents the state of the cave in ASCII at a certain step of
 /// simulation. Only includes the printable, whitespace and new line
 /// characters.
+///
+/// The data is a canvas that may be wider than the visible part of
+/// the cave.  Each row of the canvas keeps some empty margin on either
+/// side, so that widening the visible part is usually only a change
+/// of the bounds.  When a margin runs out, the canvas grows by half of
+/// its width, so widening takes amortized constant time per column.
 class Visualization {
     /// The bounds of the cave.
     Bounds bounds;
 
-    /// The visualization data.
+    /// The bounds of the canvas, which include the bounds of the cave.
+    /// Only ever wider than the cave, never taller.
+    Bounds canvas;
+
+    /// Whether the bottom row of the cave is its floor.
+    bool floor;
+
+    /// The canvas data, row by row, each row followed by a new line.
     std::string data;
 
+    size_t getStride() const { return static_cast<size_t>(this->canvas.width) + 1; }
+
 public:
     /// @brief Constructs a Visualization with default bounds and data.
-    Visualization(): bounds {}, data {} {}
+    Visualization(): bounds {}, canvas {}, floor(false), data {} {}
 
     /// @brief Constructs a Visualization with the given bounds and data.
-    Visualization(Bounds bounds, std::string&& data): bounds(bounds), data(std::move(data)) {}
+    Visualization(Bounds bounds, std::string&& data, bool floor = false):
+        bounds(bounds), canvas(bounds), floor(floor), data(std::move(data)) {}
 
     /// @brief Adds a sand cell at the given location in the Visualization.
     void addSand(int x, int y);
 
+    /// @brief Removes the sand cell at the given location, leaving what
+    /// was there before the sand came to rest: the empty space, or the
+    /// spawn point the sand blocked.
+    void removeSand(int x, int y, bool isSpawnPoint);
+
+    /// @brief Shows the given columns of the canvas only.
+    ///
+    /// The columns must be within the canvas, and the columns no
+    /// longer shown must be empty but for the floor.
+    void showColumns(int x, int width);
+
     /// @brief Resizes the cave in the Visualization.
     ///
     /// Resizes the Visualization for a cave that includes the given
@@ -368,7 +1016,7 @@ public:
     /// <code>resizeFor(int, int)</code> resizes the visualization for
     /// X, but not Y.  So it ignores the second parameter.  The reason
     /// for this is the visible height of the cave doesn't ever
-    /// change.
+    /// change.  The new columns are empty, except for the floor.
     ///
     /// @param x The X coordinate to resize for.
     /// @return Returns true if a resize happened.
@@ -377,48 +1025,610 @@ public:
     /// @brief Checks if the Visualization bounds includes the given location.
     bool includes(int x, int y) const { return this->bounds.includes(x, y); }
 
+    /// @brief Checks if the Visualization could show the given location
+    /// after a resize.
+    bool includesRow(int y) const { return y >= this->bounds.y && y < this->bounds.y + this->bounds.height; }
+
     /// @brief Converts the Visualization into a string representation.
     ///
     /// <code>intoString()</code> converts the Visualization into a string.
     /// It destroys the Visualization in the process.
-    std::string intoString() { return std::move(this->data); }
+    std::string intoString();
 
     /// @brief Converts the Visualization into a string representation.
-    std::string toString() const { return this->data; }
+    std::string toString() const;
+
+    /// @brief Compresses the visible part of the Visualization.
+    EncodedFrame encode() const;
+
+    /// @brief Encodes the cells that changed since the base
+    /// Visualization for the binary protocol.
+    ///
+    /// The bounds come first, as four 32-bit integers, then the number
+    /// of changes as a 32-bit integer.  Each change is the 32-bit index
+    /// of a cell within the bounds, row by row, followed by the cell
+    /// itself.  The cells the base doesn't show count as changed.
+    /// Returns nothing if the whole Visualization would be smaller.
+    std::optional<std::string> encodeChangesFrom(Visualization const& base) const;
 
     /// @brief Returns the bounds of the Visualization.
     Bounds getBounds() const { return this->bounds; }
 };
 
+/// @brief An EncodedFrame whose cells are stored elsewhere, such as in
+/// a SnapshotArchive.
+struct EncodedFrameView {
+    Bounds bounds;
+    bool floor;
+    std::string_view bytes;
+
+    /// @brief Decodes the frame into a Visualization.
+    Visualization decode() const;
+
+    /// @brief Decodes the cell at the given location only, or returns
+    /// '.' if the location is out of the bounds.
+    char findCell(int x, int y) const;
+
+    /// @brief Encodes the frame for the binary protocol.
+    ///
+    /// The bounds come first, as four 32-bit integers, and the encoded
+    /// cells after.
+    std::string toMessage() const;
+};
+
+/// @brief A Visualization, compressed.
+///
+/// The cells are encoded row by row, without the new lines, one byte
+/// at a time:
+///
+/// - <code>1nnnnnnn</code> is a run of n + 1 empty cells.
+/// - <code>01nnnnnn</code> is a run of n + 1 sand cells.
+/// - <code>00aabbcc</code> is three cells, each a 2-bit code: 0 is
+///   empty, 1 a wall, 2 sand and 3 the spawn point.  Codes past the
+///   last cell are ignored.
+///
+/// A frame that is mostly empty, or mostly sand, takes a fraction of
+/// the byte per cell of its Visualization.
+class EncodedFrame {
+    Bounds bounds;
+    bool floor;
+    std::string bytes;
+
+public:
+    EncodedFrame(Bounds bounds, bool floor, std::string&& bytes):
+        bounds(bounds), floor(floor), bytes(std::move(bytes)) {}
+
+    EncodedFrameView view() const { return { this->bounds, this->floor, this->bytes }; }
+
+    /// @brief Decodes the frame into a Visualization.
+    Visualization decode() const { return this->view().decode(); }
+
+    /// @brief Encodes the frame for the binary protocol.
+    std::string toMessage() const { return this->view().toMessage(); }
+
+    /// @brief Returns the bounds of the frame.
+    Bounds getBounds() const { return this->bounds; }
+
+    /// @brief Returns the number of bytes the cells are encoded in.
+    size_t size() const { return this->bytes.size(); }
+};
+
 /// Represents the checkpoint snapshot of the cave.  Several subsequent
 /// snapshots will be a sequence of deltas from this checkpoint.
 struct Checkpoint {
-    /// The visualization data at this checkpoint.
-    Visualization visualization;
+    /// The visualization data at this checkpoint, compressed until it
+    /// is needed.
+    EncodedFrame frame;
 
     /// Takes a Checkpoint Snapshot.
     Checkpoint(Cave const&);
 
-    /// Applies the given <code>delta</code> to the checkpoint snapshot.
-    void apply(Delta const&);
+    /// Decodes the visualization data at this checkpoint.
+    Visualization decode() const { return this->frame.decode(); }
 
     /// @brief Checks if the Checkpoint would show a Coordinate.
-    bool includes(Coordinate c) const { return this->visualization.includes(c.x, c.y); }
+    bool includes(Coordinate c) const { return this->frame.getBounds().includes(c.x, c.y); }
 };
 
 using Snapshot = std::variant<Checkpoint, Delta>;
 
-struct ServiceOfVisualisation {
-    std::string address;
-    std::vector<Snapshot> snapshots;
-    void start(zmq::context_t&&);
+/// A Snapshot whose Checkpoint is stored elsewhere.
+using SnapshotView = std::variant<EncodedFrameView, Delta>;
+
+/// @brief Writes the snapshots of a run to an archive file, as they are
+/// recorded.
+///
+/// The file starts with a header: the magic <code>RRSNAP01</code>, the
+/// number of snapshots, and the offset of the index, each a 64-bit
+/// integer.  The snapshots follow one after another, and the index
+/// comes last, with the 64-bit offset of each snapshot.  A Checkpoint
+/// is a 0 byte, its bounds as four 32-bit integers, a byte for the
+/// floor, the 64-bit size of its encoded cells and the cells.  A Delta
+/// is a 1 byte, then its checkpoint, x and y as 32-bit integers.  All
+/// of the integers are in the byte order of the machine.
+class ArchiveWriter {
+public:
+    /// @brief Starts writing the archive file.  It replaces any file at
+    /// the path once it is finished.
+    ArchiveWriter(std::string const& path);
+
+    ArchiveWriter(ArchiveWriter const&) = delete;
+    ArchiveWriter& operator=(ArchiveWriter const&) = delete;
+
+    /// @brief Removes the partial file, unless the archive was finished.
+    ~ArchiveWriter();
+
+    /// @brief Appends the snapshot to the archive.
+    void append(Snapshot const&);
+
+    /// @brief Writes the index of the archive, and moves it to the path.
+    void finish();
+
+private:
+    std::string path;
+    std::ofstream out;
+    std::vector<uint64_t> offsets {};
+    bool isFinished = false;
+};
+
+/// @brief Reads the snapshots of a run from an archive file, which may
+/// be larger than the memory.
+///
+/// The file is mapped into memory, and the snapshots are read from the
+/// mapping where they are, only as they are needed.  See ArchiveWriter
+/// for the format.
+class SnapshotArchive {
+public:
+    /// @brief Maps the archive file, and checks its index.
+    SnapshotArchive(std::string const& path);
+
+    SnapshotArchive(SnapshotArchive const&) = delete;
+    SnapshotArchive& operator=(SnapshotArchive const&) = delete;
+
+    ~SnapshotArchive();
+
+    size_t size() const { return this->count; }
+
+    /// @brief Reads the snapshot at the index.  A Checkpoint refers to
+    /// the mapping, so it's only valid as long as the archive.
+    SnapshotView at(int index) const;
 
 private:
-    void run(zmq::context_t&&);
+    char const* data = nullptr;
+    size_t length = 0;
+    size_t count = 0;
+    size_t indexOffset = 0;
+
+    size_t getOffset(int index) const;
+};
+
+/// Where the snapshots of a run are read from.
+using SnapshotSource = std::variant<std::vector<Snapshot> const*, SnapshotArchive const*>;
+
+/// Limits the work of rebuilding a frame, and the memory of the
+/// snapshots.  Both are in bytes.
+struct RecordingBudget {
+    /// The most a frame may cost to rebuild: copying its Checkpoint,
+    /// and then applying each Delta since, which costs as much as
+    /// copying <code>DELTA_COST</code> bytes.
+    size_t maxReplayCost = 1 << 20;
+
+    /// The most memory all of the snapshots may take up.  Once the
+    /// Checkpoints would take up more, only Deltas are recorded, even
+    /// if rebuilding a frame goes over its budget.
+    size_t maxMemory = 64 << 20;
+
+    static constexpr size_t DELTA_COST = 64;
+};
+
+class LiveStream;
+
+/// @brief Records the snapshots of a run for the visualisation.
+///
+/// Records a Delta from the last Checkpoint for every grain of sand
+/// that comes to rest, which widens the Checkpoint as it is applied if
+/// the grain came to rest beside it.  Takes a new Checkpoint once
+/// rebuilding the next frame would go over the budget, provided the
+/// memory budget allows it.  A large cave costs more to copy, so its
+/// Checkpoints are taken more often, while a small cave gets by with
+/// few of them.
+class Recorder {
+    std::vector<Snapshot> snapshots {};
+    int lastCheckpoint = 0;
+    RecordingBudget budget;
+
+    /// The number of snapshots recorded.
+    int count = 0;
+
+    /// The bounds of the last Checkpoint.
+    Bounds checkpointBounds {};
+
+    /// The number of Deltas since the last Checkpoint.
+    size_t deltas = 0;
+
+    /// The memory the snapshots take up.
+    size_t memory = 0;
+
+    /// Where the snapshots are published as they are recorded, if
+    /// anywhere.
+    LiveStream* stream = nullptr;
+
+    /// Whether a snapshot failed to be published since the last
+    /// Checkpoint that was.
+    bool streamBroken = false;
+
+    /// Where the snapshots are written instead of kept, if anywhere.
+    ArchiveWriter* archive = nullptr;
+
+    void record(Snapshot&& snapshot, Cave const& cave);
+    void publish(int index, Snapshot const& snapshot, Cave const& cave);
+
+public:
+    Recorder(RecordingBudget budget = {}): budget(budget) {}
+
+    /// Publishes every snapshot recorded from now on to the stream,
+    /// which must outlive the recorder.
+    void setStream(LiveStream* stream) { this->stream = stream; }
+
+    /// Writes every snapshot recorded from now on to the archive,
+    /// which must outlive the recorder, instead of keeping them.
+    void setArchive(ArchiveWriter* archive) { this->archive = archive; }
+
+    /// Takes a Checkpoint of the cave.
+    void recordCheckpoint(Cave const& cave);
+
+    /// Records a grain of sand that has come to rest in the cave.
+    void recordRest(Cave const& cave, Coordinate restingCoordinate);
+
+    std::vector<Snapshot> intoSnapshots() { return std::move(this->snapshots); }
+};
+
+/// @brief Reconstructs the frames of a run from its snapshots.
+///
+/// Keeps the frames it built last, up to a fixed number of them.  A
+/// frame is built by stepping forward or backward from the nearest
+/// frame kept that is based on the same Checkpoint, or from the
+/// Checkpoint itself if it is nearer.  Scrubbing through the frames
+/// then costs the distance scrubbed, rather than the distance from
+/// the last Checkpoint.  The snapshots must outlive the cache, which
+/// keeps at least two frames.
+class FrameCache {
+public:
+    FrameCache(SnapshotSource snapshots, size_t capacity = 8):
+        snapshots(snapshots), capacity(std::max<size_t>(2, capacity)) {
+        this->frames.reserve(this->capacity);
+    }
+
+    FrameCache(std::vector<Snapshot> const& snapshots, size_t capacity = 8):
+        FrameCache(SnapshotSource { &snapshots }, capacity) {}
+
+    /// @brief Returns the number of frames.
+    size_t size() const;
+
+    std::string load(int index);
+
+    /// @brief Loads the frame encoded for the binary protocol.
+    std::string loadEncoded(int index);
+
+    /// @brief Loads the changes from the frame at <code>base</code> to
+    /// the frame at <code>index</code>, encoded for the binary protocol.
+    ///
+    /// Returns nothing if the whole frame would be smaller.
+    std::optional<std::string> loadChanges(int base, int index);
+
+    /// @brief Loads every <code>stride</code>th frame from
+    /// <code>from</code> up to <code>to</code>, inclusive.
+    std::vector<std::string> loadRange(int from, int to, int stride = 1);
+
+private:
+    struct Frame {
+        int index;
+        Visualization visualization;
+
+        /// When the frame was last used, to evict the least recent.
+        uint64_t lastUse;
+    };
+
+    SnapshotSource snapshots;
+    size_t capacity;
+    std::vector<Frame> frames {};
+    uint64_t clock = 0;
+
+    SnapshotView at(int index) const;
+    int findCheckpointOf(int index) const;
+    Visualization reconstruct(int index);
+    Visualization const& fetch(int index);
+    Visualization const& keep(int index, Visualization visualization);
+};
+
+/// @brief A bounded queue between a single producer and a single
+/// consumer, neither of which ever waits for the other.
+///
+/// The capacity must be a power of two.
+template <typename T>
+class SpscQueue {
+    std::vector<std::optional<T>> slots;
+
+    /// The number of values popped so far.  Only the consumer writes it.
+    alignas(64) std::atomic<size_t> head { 0 };
+
+    /// The number of values pushed so far.  Only the producer writes it.
+    alignas(64) std::atomic<size_t> tail { 0 };
+
+public:
+    explicit SpscQueue(size_t capacity): slots(capacity) {
+        assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    }
+
+    /// @brief Pushes the value unless the queue is full.
+    /// @return Returns false if the queue was full.
+    bool tryPush(T&& value) {
+        auto tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - this->head.load(std::memory_order_acquire) == this->slots.size()) {
+            return false;
+        }
+        this->slots[tail & (this->slots.size() - 1)].emplace(std::move(value));
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Pops the oldest value, if there is any.
+    std::optional<T> tryPop() {
+        auto head = this->head.load(std::memory_order_relaxed);
+        if (head == this->tail.load(std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        auto& slot = this->slots[head & (this->slots.size() - 1)];
+        std::optional<T> value { std::move(slot) };
+        slot.reset();
+        this->head.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+    /// @brief Checks if a push would fail.  Only meaningful to the producer.
+    bool isFull() const {
+        return this->tail.load(std::memory_order_relaxed) - this->head.load(std::memory_order_acquire) == this->slots.size();
+    }
+};
+
+/// @brief Publishes the snapshots of a run while the simulation is
+/// still going.
+///
+/// A thread of its own sends the snapshots from a PUB socket, so the
+/// simulation only ever hands them over to a bounded queue.  When the
+/// queue is full, the snapshot is dropped rather than waited for.
+/// Each message is either <code>["CHECKPOINT", index, frame]</code>,
+/// where the frame is encoded as EncodedFrame::toMessage does, or
+/// <code>["DELTA", index, x, y]</code>, where a Delta applies to the
+/// last Checkpoint published.
+class LiveStream {
+public:
+    /// @brief Binds the PUB socket to the address, and starts publishing.
+    LiveStream(zmq::context_t& context, std::string const& address, size_t capacity);
+
+    LiveStream(LiveStream const&) = delete;
+    LiveStream& operator=(LiveStream const&) = delete;
+
+    /// @brief Publishes what is left in the queue, and stops.
+    ~LiveStream();
+
+    /// @brief Queues the snapshot to be published.
+    /// @return Returns false if the snapshot was dropped.
+    bool publish(int index, Snapshot snapshot);
+
+    /// @brief Checks if the next snapshot would be dropped.
+    bool isFull() const { return this->queue.isFull(); }
+
+private:
+    struct Record {
+        int index;
+        Snapshot snapshot;
+    };
+
+    SpscQueue<Record> queue;
+    std::atomic<bool> done { false };
+    std::thread publisher;
+
+    void run(zmq::socket_t socket);
+};
+
+/// @brief Serves the frames of runs to the clients of the visualisation.
+///
+/// A front end takes the requests of any number of clients, and hands
+/// them out to a pool of workers, which build the frames in parallel.
+/// The service outlives the runs.  Publishing a run swaps its snapshots
+/// in for those of the last one at once, so each request is answered
+/// from one run or the other.
+///
+/// <code>GET step</code> replies with the frame as text, and
+/// <code>GETRANGE from to [stride]</code> with several of them.
+/// <code>GETDELTA step [lastStep]</code> replies with either
+/// <code>FRAME</code> and the encoded frame, or <code>CHANGES</code>
+/// and the cells that changed since the last step the client has got.
+/// <code>STOP</code> tells the service a client is done, and is only
+/// acknowledged: other clients may still be on the same run, so its
+/// frames stay until the next run is published.
+class ServiceOfVisualisation {
+public:
+    static inline const std::string DEFAULT_ADDRESS { "tcp://*:22143" };
+
+    /// @brief Binds the address, and serves no frames until a run is
+    /// published.
+    ServiceOfVisualisation(std::string const& address = DEFAULT_ADDRESS, size_t workerCount = 4);
+
+    ServiceOfVisualisation(ServiceOfVisualisation const&) = delete;
+    ServiceOfVisualisation& operator=(ServiceOfVisualisation const&) = delete;
+
+    /// @brief Stops the service.
+    ~ServiceOfVisualisation();
+
+    /// @brief Returns the service at the default address, which is
+    /// started the first time it is needed, and runs until the process
+    /// exits.
+    static ServiceOfVisualisation& getDefault();
+
+    /// @brief Serves the snapshots from now on.
+    void publish(std::vector<Snapshot>&& snapshots);
+
+    /// @brief Serves the snapshots of the archive from now on.
+    void publishArchive(std::string const& path);
+
+    /// @brief Serves no frames from now on.
+    void clear();
+
+    /// @brief Stops serving, and waits for the requests in progress.
+    void stop();
+
+    zmq::context_t& getContext() { return this->context; }
+
+private:
+    /// The snapshots of a run, in memory or in an archive.
+    struct Run {
+        std::vector<Snapshot> snapshots {};
+        std::optional<SnapshotArchive> archive {};
+
+        SnapshotSource getSource() const;
+    };
+
+    zmq::context_t context {};
+    size_t workerCount;
+    std::mutex mutex {};
+    std::shared_ptr<Run const> run;
+    std::thread frontEnd {};
+
+    void setRun(std::shared_ptr<Run const> run);
+    std::shared_ptr<Run const> getRun();
+    void serve(zmq::socket_t frontend, zmq::socket_t backend);
+    void runWorker();
+};
+
+/// @brief Indexes where each grain of sand of a run came to rest.
+///
+/// The grains are numbered in the order they came to rest, so grain
+/// <code>n</code> is the one that settled at step <code>n + 1</code>.
+/// Besides the coordinate of each grain, the index keeps the grains
+/// sorted by position, the first grain of each row, and a merge sort
+/// tree over the grains by column: each level of the tree holds the
+/// grains sorted by column, in blocks of twice the size of the level
+/// below, with each block sorted by grain.  Every query is a binary
+/// search, or one in each of a logarithmic number of blocks, without
+/// replaying any snapshots.
+class RestingIndex {
+public:
+    RestingIndex() = default;
+
+    /// @param restingCoordinates The coordinate of each grain, in the
+    ///        order they came to rest.
+    explicit RestingIndex(std::vector<Coordinate>&& restingCoordinates);
+
+    /// The number of grains that came to rest.
+    size_t size() const { return this->coordinates.size(); }
+
+    Coordinate getRestingCoordinate(int grain) const { return this->coordinates.at(grain); }
+
+    /// Finds the grain that came to rest at the coordinate, if any.
+    std::optional<int> findGrainAt(Coordinate) const;
+
+    /// Finds the first grain that came to rest in the row, if any.
+    std::optional<int> findFirstGrainInRow(int y) const;
+
+    /// @brief Counts the grains in the columns after the given number
+    /// of steps.
+    ///
+    /// @param steps The number of grains that had come to rest.
+    /// @param columns The X range of the region of the cave.
+    int countGrains(int steps, Interval columns) const;
+
+private:
+    /// The resting coordinate of each grain.
+    std::vector<Coordinate> coordinates {};
+
+    /// The grains sorted by X, and then by Y.
+    std::vector<int> grainsByPosition {};
+
+    /// The first grain of each row, sorted by row.
+    std::vector<std::pair<int, int>> firstGrainsOfRows {};
+
+    /// The levels of the merge sort tree over <code>grainsByPosition</code>.
+    /// Level <code>k</code> is sorted by grain in blocks of
+    /// <code>2^k</code>.
+    std::vector<std::vector<int>> levels {};
+};
+
+/// Selects how the simulation drops each grain of sand.
+enum class Strategy {
+    /// Simulates every grain all the way from the spawn point.
+    FromSpawn,
+
+    /// Resumes every grain from the path of the previous grain.
+    ResumePath,
+
+    /// Drops several grains at once, keeping the grains in flight far
+    /// enough apart that they come to rest as if dropped one by one.
+    Pipelined,
+
+    /// Computes the pile of sand row by row, without simulating the
+    /// grains.  Only works for a cave with a horizontal floor.
+    RowPropagation,
+};
+
+/// Tunes how a run of the simulation goes about its work.  Other than
+/// the spawn points and their policy, none of the options change the
+/// answer.
+struct Options {
+    /// The storage backend of the cave.
+    Storage storage = Storage::Buckets;
+
+    /// The way the grains of sand are simulated.
+    Strategy strategy = Strategy::FromSpawn;
+
+    /// The budget of the snapshots of the visualisation.
+    RecordingBudget recordingBudget = {};
+
+    /// The file the trace of the simulation is written to at the end
+    /// of the run, even if it fails.
+    std::optional<std::string> tracePath = std::nullopt;
+
+    /// The address the snapshots are published at while the
+    /// simulation runs, if anywhere.  Only with the visualisation.
+    std::optional<std::string> streamAddress = std::nullopt;
+
+    /// The number of snapshots that may wait to be published, a power
+    /// of two.  Any more are dropped until a Checkpoint gets through.
+    size_t streamCapacity = 1024;
+
+    /// The file the snapshots are archived in, if any.  The
+    /// visualisation then serves the frames from the archive, rather
+    /// than keeping the snapshots in memory.
+    std::optional<std::string> archivePath = std::nullopt;
+
+    /// The service the visualisation is published to, if not the
+    /// default one.
+    ServiceOfVisualisation* service = nullptr;
+
+    /// @brief The spawn points the sand is released from.
+    ///
+    /// In Part 2, the spawn points far enough apart that their sand
+    /// can't meet split the cave into regions by X range, which are
+    /// simulated on threads of their own.  The pile doesn't depend on
+    /// the order the grains come to rest in there.  Only without the
+    /// visualisation or the trace, which follow a single order.
+    std::vector<Coordinate> spawnPoints = { SPAWN_POINT };
+
+    /// Which spawn point releases the next grain of sand.
+    SpawnPolicy spawnPolicy = SpawnPolicy::RoundRobin;
+
+    /// @brief The index the grains are written to at the end of the
+    /// run, if any.
+    ///
+    /// The index follows the order the grains came to rest in, so the
+    /// regions of the cave are then simulated on a single thread, and
+    /// there is no index of a run by row propagation.
+    RestingIndex* restingIndex = nullptr;
 };
 
-std::string runPart1(std::string&& input, bool enableVisualisation);
-std::string runPart2(std::string&& input, bool enableVisualisation);
+std::string runPart1(std::string&& input, bool enableVisualisation, Options options = {});
+std::string runPart2(std::string&& input, bool enableVisualisation, Options options = {});
 
 }
 
@@ -0,0 +1,229 @@
+//
+//  RegolithReservoirArchive.cpp
+//  aoc2022
+//
+//  Created by Hee Suk Shin on 2023/08/21.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CppErrorCode.h"
+#include "utility.h"
+#include "RegolithReservoir.hpp"
+
+namespace rr {
+
+/// Identifies the format of an archive file.  The last two characters
+/// are the version of the format.
+static constexpr char ARCHIVE_MAGIC[8] = { 'R', 'R', 'S', 'N', 'A', 'P', '0', '1' };
+
+static constexpr size_t ARCHIVE_HEADER_SIZE = sizeof(ARCHIVE_MAGIC) + 2 * sizeof(uint64_t);
+
+enum class ArchiveRecord: uint8_t {
+    Checkpoint = 0,
+    Delta = 1,
+};
+
+/// The size of a Checkpoint record before its encoded cells.
+static constexpr size_t CHECKPOINT_RECORD_SIZE = 1 + 4 * sizeof(int32_t) + 1 + sizeof(uint64_t);
+
+/// The size of a Delta record.
+static constexpr size_t DELTA_RECORD_SIZE = 1 + 3 * sizeof(int32_t);
+
+template <typename T>
+static void writeValue(std::ostream& out, T value) {
+    out.write(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+/// Reads a value from the mapping, which doesn't have to be aligned.
+template <typename T>
+static T readValue(char const* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+ArchiveWriter::ArchiveWriter(std::string const& path):
+    path(path), out(path + ".partial", std::ios::binary | std::ios::trunc) {
+    if (!this->out) {
+        throw CppErrorCodeInput;
+    }
+
+    // The number of snapshots and the offset of the index are only
+    // known once the archive is finished.
+    this->out.write(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    writeValue<uint64_t>(this->out, 0);
+    writeValue<uint64_t>(this->out, 0);
+}
+
+ArchiveWriter::~ArchiveWriter() {
+    if (!this->isFinished) {
+        // The run didn't get to the end, so there's no archive to keep.
+        this->out.close();
+        std::remove((this->path + ".partial").c_str());
+    }
+}
+
+void ArchiveWriter::append(Snapshot const& snapshot) {
+    this->offsets.push_back(static_cast<uint64_t>(this->out.tellp()));
+    std::visit(overloaded {
+        [this] (Checkpoint const& checkpoint) {
+            auto frame = checkpoint.frame.view();
+            writeValue(this->out, ArchiveRecord::Checkpoint);
+            writeValue<int32_t>(this->out, frame.bounds.x);
+            writeValue<int32_t>(this->out, frame.bounds.y);
+            writeValue<int32_t>(this->out, frame.bounds.width);
+            writeValue<int32_t>(this->out, frame.bounds.height);
+            writeValue<uint8_t>(this->out, frame.floor);
+            writeValue<uint64_t>(this->out, frame.bytes.size());
+            this->out.write(frame.bytes.data(), frame.bytes.size());
+        },
+        [this] (Delta const& delta) {
+            writeValue(this->out, ArchiveRecord::Delta);
+            writeValue<int32_t>(this->out, delta.checkpoint);
+            writeValue<int32_t>(this->out, delta.x);
+            writeValue<int32_t>(this->out, delta.y);
+        },
+    }, snapshot);
+}
+
+void ArchiveWriter::finish() {
+    auto indexOffset = static_cast<uint64_t>(this->out.tellp());
+    for (auto offset : this->offsets) {
+        writeValue(this->out, offset);
+    }
+
+    this->out.seekp(sizeof(ARCHIVE_MAGIC));
+    writeValue<uint64_t>(this->out, this->offsets.size());
+    writeValue<uint64_t>(this->out, indexOffset);
+    this->out.close();
+    if (!this->out) {
+        throw CppErrorCodeInput;
+    }
+
+    // Replace the archive in one go.  A service still serving the
+    // last archive at the path keeps the file it has mapped.
+    if (std::rename((this->path + ".partial").c_str(), this->path.c_str()) != 0) {
+        throw CppErrorCodeInput;
+    }
+    this->isFinished = true;
+}
+
+SnapshotArchive::SnapshotArchive(std::string const& path) {
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        throw CppErrorCodeInput;
+    }
+
+    struct stat status;
+    if (fstat(file, &status) != 0) {
+        close(file);
+        throw CppErrorCodeInput;
+    }
+    this->length = static_cast<size_t>(status.st_size);
+    if (this->length < ARCHIVE_HEADER_SIZE) {
+        close(file);
+        throw CppErrorCodeParse;
+    }
+
+    // The mapping stays valid after the file is closed.
+    void* mapping = mmap(nullptr, this->length, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED) {
+        throw CppErrorCodeInput;
+    }
+    this->data = static_cast<char const*>(mapping);
+
+    try {
+        if (!std::equal(ARCHIVE_MAGIC, ARCHIVE_MAGIC + sizeof(ARCHIVE_MAGIC), this->data)) {
+            throw CppErrorCodeParse;
+        }
+        auto count = readValue<uint64_t>(this->data + sizeof(ARCHIVE_MAGIC));
+        auto indexOffset = readValue<uint64_t>(this->data + sizeof(ARCHIVE_MAGIC) + sizeof(uint64_t));
+        if (indexOffset < ARCHIVE_HEADER_SIZE || indexOffset > this->length ||
+            count > (this->length - indexOffset) / sizeof(uint64_t)) {
+            throw CppErrorCodeParse;
+        }
+        this->count = count;
+        this->indexOffset = indexOffset;
+
+        // Check that every record is within the snapshots, so that
+        // reading one never goes past the mapping, and that every Delta
+        // is from the last Checkpoint.  Only the headers of the records
+        // are read.
+        int64_t lastCheckpoint = -1;
+        for (size_t index = 0; index < this->count; ++index) {
+            auto offset = this->getOffset(static_cast<int>(index));
+            if (offset < ARCHIVE_HEADER_SIZE || offset >= this->indexOffset) {
+                throw CppErrorCodeParse;
+            }
+            auto available = this->indexOffset - offset;
+            switch (static_cast<ArchiveRecord>(this->data[offset])) {
+                case ArchiveRecord::Checkpoint:
+                    if (available < CHECKPOINT_RECORD_SIZE ||
+                        readValue<uint64_t>(this->data + offset + CHECKPOINT_RECORD_SIZE - sizeof(uint64_t)) >
+                        available - CHECKPOINT_RECORD_SIZE) {
+                        throw CppErrorCodeParse;
+                    }
+                    lastCheckpoint = index;
+                    break;
+
+                case ArchiveRecord::Delta:
+                    if (available < DELTA_RECORD_SIZE ||
+                        readValue<int32_t>(this->data + offset + 1) != lastCheckpoint) {
+                        throw CppErrorCodeParse;
+                    }
+                    break;
+
+                default:
+                    throw CppErrorCodeParse;
+            }
+        }
+    } catch (...) {
+        munmap(const_cast<char*>(this->data), this->length);
+        throw;
+    }
+}
+
+SnapshotArchive::~SnapshotArchive() {
+    munmap(const_cast<char*>(this->data), this->length);
+}
+
+size_t SnapshotArchive::getOffset(int index) const {
+    return static_cast<size_t>(readValue<uint64_t>(this->data + this->indexOffset + index * sizeof(uint64_t)));
+}
+
+SnapshotView SnapshotArchive::at(int index) const {
+    auto record = this->data + this->getOffset(index);
+    if (static_cast<ArchiveRecord>(record[0]) == ArchiveRecord::Delta) {
+        return Delta {
+            readValue<int32_t>(record + 1),
+            { readValue<int32_t>(record + 1 + sizeof(int32_t)), readValue<int32_t>(record + 1 + 2 * sizeof(int32_t)) },
+        };
+    }
+
+    EncodedFrameView frame;
+    frame.bounds.x = readValue<int32_t>(record + 1);
+    frame.bounds.y = readValue<int32_t>(record + 1 + sizeof(int32_t));
+    frame.bounds.width = readValue<int32_t>(record + 1 + 2 * sizeof(int32_t));
+    frame.bounds.height = readValue<int32_t>(record + 1 + 3 * sizeof(int32_t));
+    frame.floor = record[1 + 4 * sizeof(int32_t)] != 0;
+    auto size = readValue<uint64_t>(record + CHECKPOINT_RECORD_SIZE - sizeof(uint64_t));
+    frame.bytes = std::string_view { record + CHECKPOINT_RECORD_SIZE, static_cast<size_t>(size) };
+    return frame;
+}
+
+}
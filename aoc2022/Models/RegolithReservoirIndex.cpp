@@ -0,0 +1,110 @@
+//
+//  RegolithReservoirIndex.cpp
+//  aoc2022
+//
+//  Created by Hee Suk Shin on 2023/08/21.
+//
+
+#include <algorithm>
+#include <bit>
+#include <numeric>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "RegolithReservoir.hpp"
+
+namespace rr {
+
+RestingIndex::RestingIndex(std::vector<Coordinate>&& restingCoordinates):
+    coordinates(std::move(restingCoordinates)) {
+    size_t count = this->coordinates.size();
+
+    this->grainsByPosition.resize(count);
+    std::iota(this->grainsByPosition.begin(), this->grainsByPosition.end(), 0);
+    std::sort(this->grainsByPosition.begin(), this->grainsByPosition.end(), [this] (int lhs, int rhs) {
+        auto a = this->coordinates[lhs], b = this->coordinates[rhs];
+        return a.x < b.x || (a.x == b.x && a.y < b.y);
+    });
+
+    // The grains of a row in the order they came to rest, so the first
+    // of each row is the one to keep.
+    std::vector<std::pair<int, int>> rows;
+    rows.reserve(count);
+    for (size_t grain = 0; grain < count; ++grain) {
+        rows.emplace_back(this->coordinates[grain].y, static_cast<int>(grain));
+    }
+    std::sort(rows.begin(), rows.end());
+    for (auto row : rows) {
+        if (this->firstGrainsOfRows.empty() || this->firstGrainsOfRows.back().first != row.first) {
+            this->firstGrainsOfRows.push_back(row);
+        }
+    }
+
+    // Each level merges the pairs of blocks of the level below.  The
+    // blocks of the first level are single grains.
+    this->levels.push_back(this->grainsByPosition);
+    for (size_t width = 1; width < count; width *= 2) {
+        auto const& below = this->levels.back();
+        std::vector<int> level(count);
+        for (size_t from = 0; from < count; from += 2 * width) {
+            auto middle = std::min(from + width, count);
+            auto to = std::min(from + 2 * width, count);
+            std::merge(below.begin() + from, below.begin() + middle,
+                       below.begin() + middle, below.begin() + to,
+                       level.begin() + from);
+        }
+        this->levels.push_back(std::move(level));
+    }
+}
+
+std::optional<int> RestingIndex::findGrainAt(Coordinate coordinate) const {
+    auto grain = std::lower_bound(this->grainsByPosition.begin(), this->grainsByPosition.end(), coordinate,
+                                  [this] (int grain, Coordinate coordinate) {
+        auto a = this->coordinates[grain];
+        return a.x < coordinate.x || (a.x == coordinate.x && a.y < coordinate.y);
+    });
+    if (grain != this->grainsByPosition.end() && this->coordinates[*grain] == coordinate) {
+        return *grain;
+    } else {
+        return std::nullopt;
+    }
+}
+
+std::optional<int> RestingIndex::findFirstGrainInRow(int y) const {
+    auto row = std::lower_bound(this->firstGrainsOfRows.begin(), this->firstGrainsOfRows.end(), y,
+                                [] (auto const& row, int y) {
+        return row.first < y;
+    });
+    if (row != this->firstGrainsOfRows.end() && row->first == y) {
+        return row->second;
+    } else {
+        return std::nullopt;
+    }
+}
+
+int RestingIndex::countGrains(int steps, Interval columns) const {
+    // The grains in the columns are a range of the positions.
+    auto from = static_cast<size_t>(std::lower_bound(
+        this->grainsByPosition.begin(), this->grainsByPosition.end(), columns.from,
+        [this] (int grain, int x) { return this->coordinates[grain].x < x; }) - this->grainsByPosition.begin());
+    auto to = static_cast<size_t>(std::upper_bound(
+        this->grainsByPosition.begin(), this->grainsByPosition.end(), columns.to,
+        [this] (int x, int grain) { return x < this->coordinates[grain].x; }) - this->grainsByPosition.begin());
+
+    // Cover the range with the largest blocks of the tree that fit, and
+    // count the grains before the step in each.
+    int count = 0;
+    while (from < to) {
+        size_t level = std::min<size_t>(std::countr_zero(from), this->levels.size() - 1);
+        while (from + (size_t { 1 } << level) > to) {
+            --level;
+        }
+        auto block = this->levels[level].begin() + from;
+        count += static_cast<int>(std::lower_bound(block, block + (size_t { 1 } << level), steps) - block);
+        from += size_t { 1 } << level;
+    }
+    return count;
+}
+
+}
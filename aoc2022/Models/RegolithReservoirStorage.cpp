@@ -0,0 +1,830 @@
+//
+//  RegolithReservoirStorage.cpp
+//  aoc2022
+//
+//  Created by Hee Suk Shin on 2023/08/14.
+//
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "CppErrorCode.h"
+#include "RegolithReservoir.hpp"
+
+namespace rr {
+
+/// Whether the first coordinate comes before the second, column by
+/// column and top to bottom.
+static bool isBefore(Coordinate lhs, Coordinate rhs) {
+    return lhs.x < rhs.x || (lhs.x == rhs.x && lhs.y < rhs.y);
+}
+
+/// Finds the first interval that ends at or after the value.
+template <typename Intervals>
+static auto findInterval(Intervals& intervals, int value) {
+    return std::lower_bound(intervals.begin(), intervals.end(), value, [] (Interval const& interval, int value) {
+        return interval.to < value;
+    });
+}
+
+static bool includes(std::vector<Interval> const& intervals, int value) {
+    auto interval = findInterval(intervals, value);
+    return interval != intervals.end() && interval->includes(value);
+}
+
+static void insertInterval(std::vector<Interval>& intervals, Interval interval) {
+    // Merge with every interval that overlaps or touches the new one.
+    auto first = std::lower_bound(intervals.begin(), intervals.end(), interval.from - 1, [] (Interval const& interval, int value) {
+        return interval.to < value;
+    });
+    auto last = first;
+    while (last != intervals.end() && last->from <= interval.to + 1) {
+        interval.from = std::min(interval.from, last->from);
+        interval.to = std::max(interval.to, last->to);
+        ++last;
+    }
+    intervals.insert(intervals.erase(first, last), interval);
+}
+
+void WallIntervals::insert(Segment const& segment) {
+    auto [from, to] = segment.coordinates;
+    if (segment.isHorizontal() && from.x != to.x) {
+        // A cell in each column it crosses.
+        for (int x = std::min(from.x, to.x); x <= std::max(from.x, to.x); ++x) {
+            insertInterval(this->columns[x], { from.y, from.y });
+        }
+    } else {
+        // Vertical segments, and segments of a single cell.
+        insertInterval(this->columns[from.x], { std::min(from.y, to.y), std::max(from.y, to.y) });
+    }
+}
+
+/// Erases the value from the intervals, and returns whether it was
+/// there.
+static bool eraseFromInterval(std::vector<Interval>& intervals, int value) {
+    auto interval = findInterval(intervals, value);
+    if (interval == intervals.end() || !interval->includes(value)) {
+        return false;
+    }
+
+    if (interval->from == interval->to) {
+        intervals.erase(interval);
+    } else if (interval->from == value) {
+        ++interval->from;
+    } else if (interval->to == value) {
+        --interval->to;
+    } else {
+        Interval upper { interval->from, value - 1 };
+        interval->from = value + 1;
+        intervals.insert(interval, upper);
+    }
+    return true;
+}
+
+void WallIntervals::erase(Coordinate coordinate) {
+    if (auto column = this->columns.find(coordinate.x); column != this->columns.end()) {
+        eraseFromInterval(column->second, coordinate.y);
+    }
+}
+
+bool WallIntervals::includes(Coordinate coordinate) const {
+    auto column = this->columns.find(coordinate.x);
+    return column != this->columns.end() && rr::includes(column->second, coordinate.y);
+}
+
+std::optional<Coordinate> WallIntervals::next(std::optional<Coordinate> after) const {
+    if (after) {
+        if (auto y = this->findRowInColumn(after->x, after->y + 1)) {
+            return Coordinate { after->x, *y };
+        }
+    }
+
+    int fromX = after ? after->x + 1 : std::numeric_limits<int>::min();
+    for (auto column = this->columns.lower_bound(fromX); column != this->columns.end(); ++column) {
+        if (!column->second.empty()) {
+            return Coordinate { column->first, column->second.front().from };
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<Coordinate> WallIntervals::findBelow(Coordinate coordinate, int before) const {
+    if (auto y = this->findRowInColumn(coordinate.x, coordinate.y + 1, before)) {
+        return Coordinate { coordinate.x, *y };
+    } else {
+        return std::nullopt;
+    }
+}
+
+/// Finds the first row at or after the given one, and before the
+/// other, with a wall in the column.
+std::optional<int> WallIntervals::findRowInColumn(int x, int fromY, int before) const {
+    auto column = this->columns.find(x);
+    if (column == this->columns.end()) {
+        return std::nullopt;
+    }
+
+    auto interval = findInterval(column->second, fromY);
+    if (interval != column->second.end() && std::max(interval->from, fromY) < before) {
+        return std::max(interval->from, fromY);
+    } else {
+        return std::nullopt;
+    }
+}
+
+Bounds WallIntervals::calculateBounds() const {
+    int min_x = std::numeric_limits<int>::max();
+    int max_x = std::numeric_limits<int>::min();
+    int min_y = std::numeric_limits<int>::max();
+    int max_y = std::numeric_limits<int>::min();
+
+    for (auto const& [x, intervals] : this->columns) {
+        if (!intervals.empty()) {
+            min_x = std::min(min_x, x);
+            max_x = std::max(max_x, x);
+            min_y = std::min(min_y, intervals.front().from);
+            max_y = std::max(max_y, intervals.back().to);
+        }
+    }
+
+    return { min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
+}
+
+void Skyline::reserve(Bounds bounds) {
+    this->columns.reserve(bounds.width);
+    int top = bounds.y & ~63;
+    size_t words = (bounds.y + bounds.height - 1 - top) / 64 + 1;
+    for (int x = bounds.x; x < bounds.x + bounds.width; ++x) {
+        if (auto& column = this->columns[x]; column.words.empty()) {
+            column.top = top;
+            column.words.assign(words, 0);
+        }
+    }
+}
+
+void Skyline::insert(Coordinate coordinate) {
+    auto& column = this->columns[coordinate.x];
+    int top = coordinate.y & ~63;
+    if (column.words.empty()) {
+        column.top = top;
+    } else if (top < column.top) {
+        column.words.insert(column.words.begin(), (column.top - top) / 64, 0);
+        column.top = top;
+    }
+
+    size_t word = (coordinate.y - column.top) / 64;
+    if (word >= column.words.size()) {
+        column.words.resize(word + 1, 0);
+    }
+    column.words[word] |= uint64_t { 1 } << (coordinate.y & 63);
+}
+
+void Skyline::erase(Coordinate coordinate) {
+    auto column = this->columns.find(coordinate.x);
+    if (column != this->columns.end() && coordinate.y >= column->second.top) {
+        size_t word = (coordinate.y - column->second.top) / 64;
+        if (word < column->second.words.size()) {
+            column->second.words[word] &= ~(uint64_t { 1 } << (coordinate.y & 63));
+        }
+    }
+}
+
+bool Skyline::includes(Coordinate coordinate) const {
+    auto below = this->findBelow({ coordinate.x, coordinate.y - 1 });
+    return below && below->y == coordinate.y;
+}
+
+std::optional<Coordinate> Skyline::findBelow(Coordinate coordinate) const {
+    auto column = this->columns.find(coordinate.x);
+    if (column == this->columns.end()) {
+        return std::nullopt;
+    }
+
+    auto& words = column->second.words;
+    int row = std::max(0, coordinate.y + 1 - column->second.top);
+    for (size_t word = row / 64; word < words.size(); ++word) {
+        uint64_t bits = words[word];
+        if (word == static_cast<size_t>(row / 64)) {
+            bits &= ~uint64_t { 0 } << (row % 64);
+        }
+        if (bits) {
+            return Coordinate { coordinate.x, column->second.top + static_cast<int>(word * 64) + std::countr_zero(bits) };
+        }
+    }
+
+    // If an object would fall to the endless depth.
+    return std::nullopt;
+}
+
+void* NodePool::allocate(size_t size) {
+    // Keep every node aligned as a chunk is.
+    size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    if (auto& free = this->findFreeNodes(size)) {
+        return std::exchange(free, free->next);
+    }
+
+    if (this->remaining < size) {
+        size_t chunkSize = std::max(this->nextChunkSize, size);
+        this->chunks.push_back(std::make_unique<std::byte[]>(chunkSize));
+        this->cursor = this->chunks.back().get();
+        this->remaining = chunkSize;
+        this->nextChunkSize = std::min(2 * this->nextChunkSize, MAX_CHUNK_SIZE);
+    }
+    this->remaining -= size;
+    return std::exchange(this->cursor, this->cursor + size);
+}
+
+void NodePool::deallocate(void* node, size_t size) {
+    size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    auto& free = this->findFreeNodes(size);
+    free = new (node) FreeNode { free };
+}
+
+NodePool::FreeNode*& NodePool::findFreeNodes(size_t size) {
+    // A storage only has a couple of sizes of nodes.
+    for (auto& [nodeSize, free] : this->freeNodes) {
+        if (nodeSize == size) {
+            return free;
+        }
+    }
+    return this->freeNodes.emplace_back(size, nullptr).second;
+}
+
+std::optional<CellType> BucketStorage::find(Coordinate coordinate) const {
+    if (this->walls.includes(coordinate)) {
+        return CellType::Wall;
+    }
+
+    auto bucket = this->buckets.find(coordinate.x);
+    if (bucket == this->buckets.end()) {
+        return std::nullopt;
+    } else if (auto cell = bucket->second.find(coordinate.y); cell != bucket->second.end()) {
+        return cell->second.getType();
+    } else {
+        return std::nullopt;
+    }
+}
+
+void BucketStorage::insert(Cell&& cell) {
+    auto coordinate = cell.getCoordinate();
+    if (cell.getType() != CellType::Wall) {
+        // Changing the type of a cell reuses its node.
+        if (auto bucket = this->buckets.find(coordinate.x); bucket != this->buckets.end()) {
+            if (auto existing = bucket->second.find(coordinate.y); existing != bucket->second.end()) {
+                existing->second = std::move(cell);
+                return;
+            }
+        }
+    }
+
+    // A cell replaces whatever was at its coordinate.
+    this->erase(coordinate);
+
+    if (cell.getType() == CellType::Wall) {
+        this->walls.insert(Segment { std::make_pair(coordinate, coordinate) });
+        return;
+    }
+
+    this->skyline.insert(coordinate);
+
+    auto& bucket = this->findOrInsertBucket(cell.getCoordinate().x);
+    bucket.insert_or_assign(cell.getCoordinate().y, std::move(cell));
+}
+
+void BucketStorage::insertSegment(Segment const& segment) {
+    // The walls replace whatever was in their way.
+    auto [from, to] = segment.coordinates;
+    for (int x = std::min(from.x, to.x); x <= std::max(from.x, to.x); ++x) {
+        if (auto bucket = this->buckets.find(x); bucket != this->buckets.end()) {
+            auto& cells = bucket->second;
+            auto first = cells.lower_bound(std::min(from.y, to.y));
+            auto last = cells.upper_bound(std::max(from.y, to.y));
+            for (auto cell = first; cell != last; ++cell) {
+                this->skyline.erase(cell->second.getCoordinate());
+            }
+            cells.erase(first, last);
+        }
+    }
+
+    this->walls.insert(segment);
+}
+
+void BucketStorage::erase(Coordinate coordinate) {
+    this->walls.erase(coordinate);
+    this->skyline.erase(coordinate);
+
+    auto bucket = this->buckets.find(coordinate.x);
+    if (bucket != this->buckets.end()) {
+        bucket->second.erase(coordinate.y);
+        if (bucket->second.empty()) {
+            this->buckets.erase(bucket);
+        }
+    }
+}
+
+void BucketStorage::move(Coordinate from, Coordinate to) {
+    auto source = this->buckets.find(from.x);
+    if (source == this->buckets.end() || !source->second.contains(from.y)) {
+        // The walls don't move, but they can be erased and inserted.
+        auto type = this->find(from);
+        if (!type) {
+            throw CppErrorCodeState;
+        }
+        this->erase(from);
+        this->insert(Cell { *type, to });
+        return;
+    }
+
+    // Reuse the node of the cell, so that it doesn't allocate.
+    auto node = source->second.extract(from.y);
+    node.key() = to.y;
+    node.mapped().setCoordinate(to);
+    this->findOrInsertBucket(to.x).insert(std::move(node));
+
+    this->skyline.erase(from);
+    this->skyline.insert(to);
+}
+
+BucketStorage::Bucket& BucketStorage::findOrInsertBucket(int x) {
+    return this->buckets.try_emplace(x, Bucket::allocator_type { this->pool.get() }).first->second;
+}
+
+std::optional<Coordinate> BucketStorage::findObjectBelow(Coordinate coordinate) const {
+    // The sand is found first, so that only the walls above it need to
+    // be looked at.
+    auto sand = this->skyline.findBelow(coordinate);
+    if (auto wall = this->walls.findBelow(coordinate, sand ? sand->y : std::numeric_limits<int>::max())) {
+        return wall;
+    } else {
+        return sand;
+    }
+}
+
+std::optional<Cell> BucketStorage::next(std::optional<Coordinate> after) const {
+    // The next cell in the buckets.
+    Cell const* cell = nullptr;
+    auto column = after ? this->buckets.lower_bound(after->x) : this->buckets.begin();
+    if (after && column != this->buckets.end() && column->first == after->x) {
+        if (auto next = column->second.upper_bound(after->y); next != column->second.end()) {
+            cell = &next->second;
+        } else {
+            ++column;
+        }
+    }
+    for (; !cell && column != this->buckets.end(); ++column) {
+        if (!column->second.empty()) {
+            cell = &column->second.begin()->second;
+        }
+    }
+
+    // Merge it with the next wall.
+    auto wall = this->walls.next(after);
+    if (wall && (!cell || isBefore(*wall, cell->getCoordinate()))) {
+        return Cell { CellType::Wall, *wall };
+    } else if (cell) {
+        return *cell;
+    } else {
+        return std::nullopt;
+    }
+}
+
+Bounds BucketStorage::calculateBounds() const {
+    int min_x = std::numeric_limits<int>::max();
+    int max_x = std::numeric_limits<int>::min();
+    int min_y = std::numeric_limits<int>::max();
+    int max_y = std::numeric_limits<int>::min();
+
+    for (auto const& [x, bucket] : this->buckets) {
+        if (bucket.empty()) {
+            continue;
+        }
+        min_x = std::min(min_x, x);
+        max_x = std::max(max_x, x);
+        for (auto const& [y, cell] : bucket) {
+            min_y = std::min(min_y, y);
+            max_y = std::max(max_y, y);
+        }
+    }
+
+    if (auto walls = this->walls.calculateBounds(); walls.width > 0) {
+        min_x = std::min(min_x, walls.x);
+        max_x = std::max(max_x, walls.x + walls.width - 1);
+        min_y = std::min(min_y, walls.y);
+        max_y = std::max(max_y, walls.y + walls.height - 1);
+    }
+
+    return { min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
+}
+
+void BucketStorage::reserve(Bounds bounds) {
+    this->skyline.reserve(bounds);
+}
+
+void BucketStorage::assertValidity() const {
+#ifdef DEBUG
+    // Validate the columns are in the correct groups.
+    for (auto& bucket : this->buckets) {
+        for (auto& cell : bucket.second) {
+            assert(cell.second.getCoordinate().x == bucket.first);
+            assert(cell.first == cell.second.getCoordinate().y);
+            assert(this->skyline.includes(cell.second.getCoordinate()));
+        }
+    }
+#endif
+}
+
+std::optional<CellType> GridStorage::find(Coordinate coordinate) const {
+    if (this->bounds.includes(coordinate.x, coordinate.y) &&
+        (this->occupancy[this->wordOf(coordinate)] & this->bitOf(coordinate))) {
+        return this->types[this->indexOf(coordinate)];
+    } else {
+        return std::nullopt;
+    }
+}
+
+void GridStorage::insert(Cell&& cell) {
+    auto coordinate = cell.getCoordinate();
+    if (!this->bounds.includes(coordinate.x, coordinate.y)) {
+        // Grow by half of the current size on the side the cell
+        // landed, so that a cave that keeps spreading only has to be
+        // laid out again a logarithmic number of times.
+        int slackX = std::max(8, this->bounds.width / 2);
+        int slackY = std::max(8, this->bounds.height / 2);
+        int left = this->bounds.x, right = this->bounds.x + this->bounds.width;
+        int top = this->bounds.y, bottom = this->bounds.y + this->bounds.height;
+        if (this->bounds.width == 0 || this->bounds.height == 0) {
+            left = right = coordinate.x;
+            top = bottom = coordinate.y;
+        }
+        if (coordinate.x < left) {
+            left = coordinate.x - slackX;
+        } else if (coordinate.x >= right) {
+            right = coordinate.x + 1 + slackX;
+        }
+        if (coordinate.y < top) {
+            top = coordinate.y - slackY;
+        } else if (coordinate.y >= bottom) {
+            bottom = coordinate.y + 1 + slackY;
+        }
+        this->reserve({ left, top, right - left, bottom - top });
+    }
+
+    this->occupancy[this->wordOf(coordinate)] |= this->bitOf(coordinate);
+    this->types[this->indexOf(coordinate)] = cell.getType();
+}
+
+void GridStorage::insertSegment(Segment const& segment) {
+    auto [from, to] = segment.coordinates;
+    int left = std::min(from.x, to.x), right = std::max(from.x, to.x);
+    int top = std::min(from.y, to.y), bottom = std::max(from.y, to.y);
+    this->reserve({ left, top, right - left + 1, bottom - top + 1 });
+
+    for (int x = left; x <= right; ++x) {
+        for (int y = top; y <= bottom; ++y) {
+            Coordinate coordinate { x, y };
+            this->occupancy[this->wordOf(coordinate)] |= this->bitOf(coordinate);
+            this->types[this->indexOf(coordinate)] = CellType::Wall;
+        }
+    }
+}
+
+void GridStorage::erase(Coordinate coordinate) {
+    if (this->bounds.includes(coordinate.x, coordinate.y)) {
+        this->occupancy[this->wordOf(coordinate)] &= ~this->bitOf(coordinate);
+    }
+}
+
+void GridStorage::move(Coordinate from, Coordinate to) {
+    auto type = this->find(from);
+    if (!type) {
+        throw CppErrorCodeState;
+    }
+    this->occupancy[this->wordOf(from)] &= ~this->bitOf(from);
+    this->insert(Cell { *type, to });
+}
+
+std::optional<Coordinate> GridStorage::findObjectBelow(Coordinate coordinate) const {
+    if (coordinate.x < this->bounds.x || coordinate.x >= this->bounds.x + this->bounds.width) {
+        return std::nullopt;
+    }
+
+    int row = std::max(0, coordinate.y + 1 - this->bounds.y);
+    if (row >= this->bounds.height) {
+        return std::nullopt;
+    }
+
+    size_t column = coordinate.x - this->bounds.x;
+    size_t word = column * this->wordsPerColumn + row / 64;
+    size_t end = (column + 1) * this->wordsPerColumn;
+    uint64_t bits = this->occupancy[word] & (~uint64_t { 0 } << (row % 64));
+    while (true) {
+        if (bits) {
+            int y = static_cast<int>((word - column * this->wordsPerColumn) * 64) + std::countr_zero(bits);
+            return Coordinate { coordinate.x, this->bounds.y + y };
+        } else if (++word < end) {
+            bits = this->occupancy[word];
+        } else {
+            // If an object would fall to the endless depth.
+            return std::nullopt;
+        }
+    }
+}
+
+std::optional<Cell> GridStorage::next(std::optional<Coordinate> after) const {
+    size_t word = 0;
+    uint64_t mask = ~uint64_t { 0 };
+    if (after) {
+        assert(this->bounds.includes(after->x, after->y));
+        // Columns are padded to whole words, and the padding is never
+        // set.  So the bit after the last row of a column safely
+        // resumes the search from the start of the next column.
+        size_t column = after->x - this->bounds.x;
+        int row = after->y - this->bounds.y + 1;
+        word = column * this->wordsPerColumn + row / 64;
+        mask <<= row % 64;
+    }
+
+    for (; word < this->occupancy.size(); ++word, mask = ~uint64_t { 0 }) {
+        if (auto bits = this->occupancy[word] & mask) {
+            int column = static_cast<int>(word / this->wordsPerColumn);
+            int row = static_cast<int>((word % this->wordsPerColumn) * 64) + std::countr_zero(bits);
+            Coordinate coordinate { this->bounds.x + column, this->bounds.y + row };
+            return Cell { this->types[this->indexOf(coordinate)], coordinate };
+        }
+    }
+    return std::nullopt;
+}
+
+Bounds GridStorage::calculateBounds() const {
+    int min_x = std::numeric_limits<int>::max();
+    int max_x = std::numeric_limits<int>::min();
+    int min_y = std::numeric_limits<int>::max();
+    int max_y = std::numeric_limits<int>::min();
+
+    for (int column = 0; column < this->bounds.width; ++column) {
+        auto first = this->occupancy.begin() + column * this->wordsPerColumn;
+        auto last = first + this->wordsPerColumn;
+        auto top = std::find_if(first, last, [] (uint64_t bits) { return bits != 0; });
+        if (top == last) {
+            continue;
+        }
+        auto bottom = std::find_if(std::make_reverse_iterator(last),
+                                   std::make_reverse_iterator(top),
+                                   [] (uint64_t bits) { return bits != 0; });
+
+        min_x = std::min(min_x, this->bounds.x + column);
+        max_x = std::max(max_x, this->bounds.x + column);
+        min_y = std::min(min_y, this->bounds.y + static_cast<int>((top - first) * 64) + std::countr_zero(*top));
+        max_y = std::max(max_y, this->bounds.y + static_cast<int>((bottom.base() - 1 - first) * 64) + 63 - std::countl_zero(*bottom));
+    }
+
+    return { min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
+}
+
+void GridStorage::reserve(Bounds bounds) {
+    if (this->bounds.width > 0 && this->bounds.height > 0) {
+        int left = std::min(this->bounds.x, bounds.x);
+        int top = std::min(this->bounds.y, bounds.y);
+        int right = std::max(this->bounds.x + this->bounds.width, bounds.x + bounds.width);
+        int bottom = std::max(this->bounds.y + this->bounds.height, bounds.y + bounds.height);
+        bounds = { left, top, right - left, bottom - top };
+        if (bounds.x == this->bounds.x && bounds.y == this->bounds.y &&
+            bounds.width == this->bounds.width && bounds.height == this->bounds.height) {
+            // Already large enough.
+            return;
+        }
+    }
+
+    GridStorage grown;
+    grown.bounds = bounds;
+    grown.wordsPerColumn = (bounds.height + 63) / 64;
+    grown.occupancy.assign(static_cast<size_t>(bounds.width) * grown.wordsPerColumn, 0);
+    grown.types.assign(static_cast<size_t>(bounds.width) * bounds.height, CellType::Wall);
+    for (auto cell = this->next(std::nullopt); cell; cell = this->next(cell->getCoordinate())) {
+        grown.insert(Cell { *cell });
+    }
+    *this = std::move(grown);
+}
+
+thread_local size_t TileStorage::lastTile = std::numeric_limits<size_t>::max();
+
+std::optional<CellType> TileStorage::find(Coordinate coordinate) const {
+    auto tile = this->findTile(tileOf(coordinate.x), tileOf(coordinate.y));
+    if (tile && (tile->columns[offsetOf(coordinate.x)] & (uint64_t { 1 } << offsetOf(coordinate.y)))) {
+        return tile->types[typeIndexOf(coordinate)];
+    } else {
+        return std::nullopt;
+    }
+}
+
+void TileStorage::insert(Cell&& cell) {
+    auto coordinate = cell.getCoordinate();
+    auto& tile = this->obtainTile(tileOf(coordinate.x), tileOf(coordinate.y));
+    tile.columns[offsetOf(coordinate.x)] |= uint64_t { 1 } << offsetOf(coordinate.y);
+    tile.types[typeIndexOf(coordinate)] = cell.getType();
+}
+
+void TileStorage::insertSegment(Segment const& segment) {
+    auto [from, to] = segment.coordinates;
+    for (int x = std::min(from.x, to.x); x <= std::max(from.x, to.x); ++x) {
+        for (int y = std::min(from.y, to.y); y <= std::max(from.y, to.y); ++y) {
+            this->insert(Cell { CellType::Wall, { x, y } });
+        }
+    }
+}
+
+void TileStorage::erase(Coordinate coordinate) {
+    // Tiles are never freed, as cells usually come back where they left.
+    if (auto tile = this->findTile(tileOf(coordinate.x), tileOf(coordinate.y))) {
+        const_cast<Tile*>(tile)->columns[offsetOf(coordinate.x)] &= ~(uint64_t { 1 } << offsetOf(coordinate.y));
+    }
+}
+
+void TileStorage::move(Coordinate from, Coordinate to) {
+    auto type = this->find(from);
+    if (!type) {
+        throw CppErrorCodeState;
+    }
+    this->erase(from);
+    this->insert(Cell { *type, to });
+}
+
+std::optional<Coordinate> TileStorage::findObjectBelow(Coordinate coordinate) const {
+    int tileX = tileOf(coordinate.x);
+    int column = offsetOf(coordinate.x);
+    int first = tileOf(coordinate.y + 1);
+
+    for (int tileY = std::max(first, this->minTileY); tileY <= this->maxTileY; ++tileY) {
+        auto tile = this->findTile(tileX, tileY);
+        if (!tile) {
+            continue;
+        }
+
+        uint64_t bits = tile->columns[column];
+        if (tileY == first) {
+            bits &= ~uint64_t { 0 } << offsetOf(coordinate.y + 1);
+        }
+        if (bits) {
+            return Coordinate { coordinate.x, tileY * TILE_SIZE + std::countr_zero(bits) };
+        }
+    }
+
+    // If an object would fall to the endless depth.
+    return std::nullopt;
+}
+
+std::optional<Cell> TileStorage::next(std::optional<Coordinate> after) const {
+    auto position = this->order.begin();
+    int column = 0;
+    uint64_t mask = ~uint64_t { 0 };
+    if (after) {
+        position = this->findInOrder(tileOf(after->x), tileOf(after->y));
+        assert(position != this->order.end());
+        column = offsetOf(after->x);
+        int row = offsetOf(after->y) + 1;
+        mask = row < TILE_SIZE ? ~uint64_t { 0 } << row : 0;
+    }
+
+    for (; position != this->order.end(); ++position, column = 0) {
+        auto& tile = this->tiles[*position];
+        for (; column < TILE_SIZE; ++column, mask = ~uint64_t { 0 }) {
+            if (auto bits = tile.columns[column] & mask) {
+                Coordinate coordinate { tile.x * TILE_SIZE + column, tile.y * TILE_SIZE + std::countr_zero(bits) };
+                return Cell { tile.types[typeIndexOf(coordinate)], coordinate };
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+Bounds TileStorage::calculateBounds() const {
+    int min_x = std::numeric_limits<int>::max();
+    int max_x = std::numeric_limits<int>::min();
+    int min_y = std::numeric_limits<int>::max();
+    int max_y = std::numeric_limits<int>::min();
+
+    for (auto& tile : this->tiles) {
+        for (int column = 0; column < TILE_SIZE; ++column) {
+            if (auto bits = tile.columns[column]) {
+                min_x = std::min(min_x, tile.x * TILE_SIZE + column);
+                max_x = std::max(max_x, tile.x * TILE_SIZE + column);
+                min_y = std::min(min_y, tile.y * TILE_SIZE + std::countr_zero(bits));
+                max_y = std::max(max_y, tile.y * TILE_SIZE + TILE_SIZE - 1 - std::countl_zero(bits));
+            }
+        }
+    }
+
+    return { min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
+}
+
+void TileStorage::reserve(Bounds bounds) {
+    size_t count = static_cast<size_t>(tileOf(bounds.x + bounds.width - 1) - tileOf(bounds.x) + 1) *
+                   static_cast<size_t>(tileOf(bounds.y + bounds.height - 1) - tileOf(bounds.y) + 1);
+    this->tiles.reserve(count);
+    this->order.reserve(count);
+    if (count * 2 > this->slots.size()) {
+        this->rehash(std::bit_ceil(count * 2));
+    }
+}
+
+void TileStorage::assertValidity() const {
+#ifdef DEBUG
+    // Validate every tile is found through the hash, at its own index.
+    for (auto& tile : this->tiles) {
+        auto slot = this->slotOf(tile.x, tile.y);
+        assert(this->slots[slot] != 0);
+        assert(&this->tiles[this->slots[slot] - 1] == &tile);
+        assert(tile.y >= this->minTileY && tile.y <= this->maxTileY);
+    }
+
+    // Validate the order has every tile, sorted.
+    assert(this->order.size() == this->tiles.size());
+    for (size_t index = 1; index < this->order.size(); ++index) {
+        auto& before = this->tiles[this->order[index - 1]];
+        auto& after = this->tiles[this->order[index]];
+        assert(isBefore({ before.x, before.y }, { after.x, after.y }));
+    }
+#endif
+}
+
+TileStorage::Tile const* TileStorage::findTile(int tileX, int tileY) const {
+    if (lastTile < this->tiles.size()) {
+        auto& tile = this->tiles[lastTile];
+        if (tile.x == tileX && tile.y == tileY) {
+            return &tile;
+        }
+    }
+
+    if (this->slots.empty()) {
+        return nullptr;
+    }
+
+    if (auto index = this->slots[this->slotOf(tileX, tileY)]) {
+        lastTile = index - 1;
+        return &this->tiles[index - 1];
+    } else {
+        return nullptr;
+    }
+}
+
+TileStorage::Tile& TileStorage::obtainTile(int tileX, int tileY) {
+    if (auto tile = this->findTile(tileX, tileY)) {
+        return const_cast<Tile&>(*tile);
+    }
+
+    this->order.insert(this->findInOrder(tileX, tileY), static_cast<uint32_t>(this->tiles.size()));
+    this->tiles.push_back(Tile { tileX, tileY });
+    this->minTileY = std::min(this->minTileY, tileY);
+    this->maxTileY = std::max(this->maxTileY, tileY);
+    if (this->tiles.size() * 2 > this->slots.size()) {
+        this->rehash(std::max<size_t>(16, this->slots.size() * 2));
+    } else {
+        this->slots[this->slotOf(tileX, tileY)] = static_cast<uint32_t>(this->tiles.size());
+    }
+
+    lastTile = this->tiles.size() - 1;
+    return this->tiles.back();
+}
+
+/// Finds the tile in the order, or the position it would go to.
+std::vector<uint32_t>::const_iterator TileStorage::findInOrder(int tileX, int tileY) const {
+    return std::lower_bound(this->order.begin(), this->order.end(), Coordinate { tileX, tileY },
+                            [this] (uint32_t index, Coordinate coordinate) {
+        return isBefore({ this->tiles[index].x, this->tiles[index].y }, coordinate);
+    });
+}
+
+/// Finds the slot of the tile, or the empty slot it would go to.
+size_t TileStorage::slotOf(int tileX, int tileY) const {
+    uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(tileX)) << 32) | static_cast<uint32_t>(tileY);
+    size_t mask = this->slots.size() - 1;
+    // Fibonacci hashing spreads neighbouring tiles over the slots.
+    size_t slot = static_cast<size_t>((key * 0x9E3779B97F4A7C15) >> 32) & mask;
+    while (auto index = this->slots[slot]) {
+        auto& tile = this->tiles[index - 1];
+        if (tile.x == tileX && tile.y == tileY) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void TileStorage::rehash(size_t slotCount) {
+    this->slots.assign(slotCount, 0);
+    for (size_t index = 0; index < this->tiles.size(); ++index) {
+        auto& tile = this->tiles[index];
+        this->slots[this->slotOf(tile.x, tile.y)] = static_cast<uint32_t>(index + 1);
+    }
+}
+
+}
@@ -0,0 +1,158 @@
+//
+//  RegolithReservoirTrace.cpp
+//  aoc2022
+//
+//  Created by Hee Suk Shin on 2023/08/21.
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "CppErrorCode.h"
+#include "RegolithReservoir.hpp"
+
+namespace rr {
+
+/// Identifies the format of a trace file.  The last character is the
+/// version of the format.
+static constexpr char TRACE_MAGIC[8] = { 'R', 'R', 'T', 'R', 'A', 'C', 'E', '1' };
+
+template <typename T>
+static void writeValue(std::ostream& out, T value) {
+    out.write(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+template <typename T>
+static T readValue(std::istream& in) {
+    T value;
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(value))) {
+        throw CppErrorCodeParse;
+    }
+    return value;
+}
+
+Trace::Trace(size_t capacity): records(capacity) {
+    assert((capacity & (capacity - 1)) == 0);
+}
+
+std::vector<TraceRecord> Trace::listRecords(std::optional<uint32_t> grain) const {
+    uint64_t count = std::min<uint64_t>(this->written, this->records.size());
+    uint64_t first = this->written - count;
+    if (grain) {
+        // The steps of a grain are recorded one after another, so only
+        // the latest records can be of the grain.
+        first = this->written;
+        while (first > this->written - count &&
+               this->records[(first - 1) & (this->records.size() - 1)].grain == *grain) {
+            --first;
+        }
+    }
+
+    std::vector<TraceRecord> records;
+    records.reserve(this->written - first);
+    for (uint64_t index = first; index < this->written; ++index) {
+        records.push_back(this->records[index & (this->records.size() - 1)]);
+    }
+    return records;
+}
+
+void Trace::dump(std::string const& path) const {
+    std::ofstream out { path, std::ios::binary | std::ios::trunc };
+    if (!out) {
+        throw CppErrorCodeInput;
+    }
+
+    auto records = this->listRecords();
+    out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    writeValue<uint64_t>(out, this->written);
+    writeValue<uint64_t>(out, records.size());
+
+    // Field by field, so that the file doesn't depend on the padding.
+    for (auto const& record : records) {
+        writeValue(out, record.grain);
+        writeValue(out, static_cast<uint8_t>(record.action));
+        writeValue(out, record.fromX);
+        writeValue(out, record.fromY);
+        writeValue(out, record.toX);
+        writeValue(out, record.toY);
+    }
+}
+
+std::string Trace::decode(std::string const& path) {
+    std::ifstream in { path, std::ios::binary };
+    if (!in) {
+        throw CppErrorCodeInput;
+    }
+
+    char magic[sizeof(TRACE_MAGIC)];
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), TRACE_MAGIC)) {
+        throw CppErrorCodeParse;
+    }
+
+    auto written = readValue<uint64_t>(in);
+    auto count = readValue<uint64_t>(in);
+
+    std::ostringstream out;
+    out << "TRACE:[RECORDS:" << count << ",DROPPED:" << written - count << ']' << '\n';
+    for (uint64_t index = 0; index < count; ++index) {
+        TraceRecord record;
+        record.grain = readValue<uint32_t>(in);
+        auto action = readValue<uint8_t>(in);
+        if (action > static_cast<uint8_t>(TraceAction::Resume)) {
+            throw CppErrorCodeParse;
+        }
+        record.action = static_cast<TraceAction>(action);
+        record.fromX = readValue<int32_t>(in);
+        record.fromY = readValue<int32_t>(in);
+        record.toX = readValue<int32_t>(in);
+        record.toY = readValue<int32_t>(in);
+        out << describe(record) << '\n';
+    }
+    return std::move(out).str();
+}
+
+std::string Trace::describe(TraceRecord const& record) {
+    Coordinate from { record.fromX, record.fromY };
+    Coordinate to { record.toX, record.toY };
+
+    std::ostringstream out;
+    out << "GRAIN:" << record.grain << " [TYPE:";
+    switch (record.action) {
+        case TraceAction::Spawn:
+            out << "Spawn," << from;
+            break;
+
+        case TraceAction::LeaveSpawn:
+            out << "LeaveSpawn," << to;
+            break;
+
+        case TraceAction::Fall:
+            out << "Fall," << from << "->" << to;
+            break;
+
+        case TraceAction::Slide:
+            out << "Slide," << from << "->" << to;
+            break;
+
+        case TraceAction::Rest:
+            out << "Rest," << from;
+            break;
+
+        case TraceAction::Destroy:
+            out << "Destroy," << from;
+            break;
+
+        case TraceAction::Resume:
+            out << "Resume," << to;
+            break;
+    }
+    out << ']';
+    return std::move(out).str();
+}
+
+}
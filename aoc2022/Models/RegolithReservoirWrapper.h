@@ -8,11 +8,175 @@
 #ifndef RegolithReservoirWrapper_h
 #define RegolithReservoirWrapper_h
 
+#import <Foundation/Foundation.h>
+
+/// The storage backend of the cave, as <code>rr::Storage</code>.
+typedef NS_ENUM(NSInteger, RegolithReservoirStorage) {
+    RegolithReservoirStorageBuckets,
+    RegolithReservoirStorageGrid,
+    RegolithReservoirStorageTiles,
+};
+
+/// The way the grains of sand are simulated, as <code>rr::Strategy</code>.
+typedef NS_ENUM(NSInteger, RegolithReservoirStrategy) {
+    RegolithReservoirStrategyFromSpawn,
+    RegolithReservoirStrategyResumePath,
+    RegolithReservoirStrategyRowPropagation,
+    RegolithReservoirStrategyPipelined,
+};
+
+/// Which spawn point releases the next grain of sand, as
+/// <code>rr::SpawnPolicy</code>.
+typedef NS_ENUM(NSInteger, RegolithReservoirSpawnPolicy) {
+    RegolithReservoirSpawnPolicyRoundRobin,
+    RegolithReservoirSpawnPolicyPriority,
+};
+
+/// Serves the frames of runs to the clients of the visualisation.  See
+/// <code>rr::ServiceOfVisualisation</code>.
+@interface RegolithReservoirService : NSObject
+
+/// Binds the address, and starts the workers that build the frames.
+- (instancetype)initWithAddress: (NSString*)address workers: (NSInteger)workerCount error: (NSError**)error NS_SWIFT_NAME(init(address:workers:));
+
+/// Serves the frames of the archive from now on.
+- (BOOL)publishArchive: (NSString*)path error: (NSError**)error;
+
+/// Stops serving.  The service stops by itself when it goes away.
+- (void)stop;
+
+@end
+
+/// A client of the visualisation service, which sends a request at a
+/// time and waits for the reply.
+@interface RegolithReservoirClient : NSObject
+
+- (instancetype)initWithAddress: (NSString*)address error: (NSError**)error NS_SWIFT_NAME(init(address:));
+
+/// Sends the request, a message for each part, and returns the parts of
+/// the reply.  Fails if the reply doesn't come within five seconds.
+- (NSArray<NSData*>*)request: (NSArray<NSString*>*)parts error: (NSError**)error NS_SWIFT_NAME(request(_:));
+
+@end
+
+/// Subscribes to the snapshots a run publishes as it goes.  See
+/// <code>rr::LiveStream</code>.
+@interface RegolithReservoirSubscriber : NSObject
+
+/// Connects to the address, and keeps trying until a run binds it.
+- (instancetype)initWithAddress: (NSString*)address error: (NSError**)error NS_SWIFT_NAME(init(address:));
+
+/// The parts of the next message, or nil if none comes within the
+/// timeout.
+- (NSArray<NSData*>*)receiveWithTimeout: (NSTimeInterval)timeout NS_SWIFT_NAME(receive(timeout:));
+
+@end
+
+/// Where each grain of sand of a run came to rest.  See
+/// <code>rr::RestingIndex</code>.
+@interface RegolithReservoirIndex : NSObject
+
+/// The number of grains that came to rest.
+@property (nonatomic, readonly) NSInteger count;
+
+- (NSInteger)columnOfGrain: (NSInteger)grain NS_SWIFT_NAME(column(ofGrain:));
+- (NSInteger)rowOfGrain: (NSInteger)grain NS_SWIFT_NAME(row(ofGrain:));
+
+/// The grain that came to rest at the location, or NSNotFound if none did.
+- (NSInteger)findGrainAtColumn: (NSInteger)x row: (NSInteger)y NS_SWIFT_NAME(findGrain(atColumn:row:));
+
+/// The first grain that came to rest in the row, or NSNotFound if none did.
+- (NSInteger)findFirstGrainInRow: (NSInteger)y NS_SWIFT_NAME(findFirstGrain(inRow:));
+
+/// Counts the grains from column <code>from</code> to <code>to</code>,
+/// inclusive, after the given number of steps.
+- (NSInteger)countGrainsAfter: (NSInteger)steps fromColumn: (NSInteger)from toColumn: (NSInteger)to NS_SWIFT_NAME(countGrains(after:from:to:));
+
+@end
+
+/// Tunes a run of the simulation.  See <code>rr::Options</code>.
+@interface RegolithReservoirOptions : NSObject
+
+@property (nonatomic) RegolithReservoirStorage storage;
+@property (nonatomic) RegolithReservoirStrategy strategy;
+
+/// The most a frame of the visualisation may cost to rebuild, in bytes.
+/// See <code>rr::RecordingBudget</code>.
+@property (nonatomic) NSInteger maxReplayCost;
+
+/// The most memory the snapshots of the visualisation may take up, in
+/// bytes.
+@property (nonatomic) NSInteger maxMemory;
+
+/// The file the last steps of the simulation are written to at the end
+/// of the run, if any.  See <code>decodeTrace:error:</code>.
+@property (nonatomic, copy) NSString* tracePath;
+
+/// The file the snapshots are archived in, if any.
+@property (nonatomic, copy) NSString* archivePath;
+
+/// The address the snapshots are published at while the simulation
+/// runs, if anywhere.
+@property (nonatomic, copy) NSString* streamAddress;
+
+/// The number of snapshots that may wait to be published, a power of
+/// two.
+@property (nonatomic) NSInteger streamCapacity;
+
+/// The service the visualisation is published to, if not the default
+/// one.
+@property (nonatomic, strong) RegolithReservoirService* service;
+
+/// The columns of the spawn points, all on the row of the spawn point
+/// of the puzzle.
+@property (nonatomic, copy) NSArray<NSNumber*>* spawnPoints;
+
+@property (nonatomic) RegolithReservoirSpawnPolicy spawnPolicy;
+
+/// The index the grains are written to at the end of the run, if any.
+@property (nonatomic, strong) RegolithReservoirIndex* restingIndex;
+
+@end
+
+/// The frames of an archived run, as the visualisation service serves them.
+@interface RegolithReservoirFrames : NSObject
+
+- (instancetype)initWithArchive: (NSString*)path error: (NSError**)error NS_SWIFT_NAME(init(archive:));
+
+/// Keeps up to <code>capacity</code> frames built from the archive, as
+/// the workers of the service do.
+- (instancetype)initWithArchive: (NSString*)path capacity: (NSInteger)capacity error: (NSError**)error NS_SWIFT_NAME(init(archive:capacity:));
+
+/// The number of frames.
+@property (nonatomic, readonly) NSInteger count;
+
+/// The frame as text, as for GET.
+- (NSString*)loadFrame: (NSInteger)index error: (NSError**)error NS_SWIFT_NAME(loadFrame(_:));
+
+/// The frame encoded for the binary protocol, as for GETDELTA without a base.
+- (NSData*)loadEncodedFrame: (NSInteger)index error: (NSError**)error NS_SWIFT_NAME(loadEncodedFrame(_:));
+
+/// The changes from the frame at <code>base</code>, as for GETDELTA, or
+/// nil if the whole frame would be smaller or either frame is out of range.
+- (NSData*)loadChangesFrom: (NSInteger)base to: (NSInteger)index NS_SWIFT_NAME(loadChanges(from:to:));
+
+@end
+
 @interface RegolithReservoirWrapper : NSObject
 
 + (NSString*)runPart1: (NSString*)input withVisualisation: (BOOL) enableVisualisation error: (NSError**)error;
 + (NSString*)runPart2: (NSString*)input withVisualisation: (BOOL) enableVisualisation error: (NSError**)error;
 
++ (NSString*)runPart1: (NSString*)input withVisualisation: (BOOL) enableVisualisation options: (RegolithReservoirOptions*)options error: (NSError**)error;
++ (NSString*)runPart2: (NSString*)input withVisualisation: (BOOL) enableVisualisation options: (RegolithReservoirOptions*)options error: (NSError**)error;
+
+/// Finds the offset of the first byte of the input that doesn't parse,
+/// or NSNotFound if all of it does.
++ (NSInteger)findParseError: (NSString*)input NS_SWIFT_NAME(findParseError(_:));
+
+/// Decodes a trace file of the simulation into text, a line for each step.
++ (NSString*)decodeTrace: (NSString*)path error: (NSError**)error;
+
 @end
 
 #endif /* RegolithReservoirWrapper_h */
@@ -8,22 +8,432 @@
 #import <Foundation/Foundation.h>
 
 #import "RegolithReservoirWrapper.h"
+#import "CppError.h"
 
+#include <algorithm>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
 #include <utility>
+#include <variant>
+#include <vector>
+
+#include <zmq.hpp>
+#include <zmq_addon.hpp>
 
 #include "RegolithReservoir.hpp"
 
+@interface RegolithReservoirService ()
+- (rr::ServiceOfVisualisation*)service;
+@end
+
+@implementation RegolithReservoirService {
+    std::unique_ptr<rr::ServiceOfVisualisation> service;
+}
+
+- (instancetype)initWithAddress: (NSString*)address workers: (NSInteger)workerCount error: (NSError**)error {
+    if (self = [super init]) {
+        try {
+            self->service = std::make_unique<rr::ServiceOfVisualisation>(std::string([address UTF8String]), static_cast<size_t>(std::max<NSInteger>(1, workerCount)));
+        } catch (CppErrorCode errorCode) {
+            if (error != nil) {
+                *error = makeError(errorCode);
+            }
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (rr::ServiceOfVisualisation*)service {
+    return self->service.get();
+}
+
+- (BOOL)publishArchive: (NSString*)path error: (NSError**)error {
+    try {
+        self->service->publishArchive(std::string([path UTF8String]));
+        return YES;
+    } catch (CppErrorCode errorCode) {
+        if (error != nil) {
+            *error = makeError(errorCode);
+        }
+        return NO;
+    }
+}
+
+- (void)stop {
+    self->service->stop();
+}
+
+@end
+
+@implementation RegolithReservoirClient {
+    zmq::context_t context;
+    zmq::socket_t socket;
+}
+
+- (instancetype)initWithAddress: (NSString*)address error: (NSError**)error {
+    if (self = [super init]) {
+        try {
+            self->socket = zmq::socket_t { self->context, zmq::socket_type::req };
+            self->socket.set(zmq::sockopt::rcvtimeo, 5000);
+            self->socket.set(zmq::sockopt::linger, 0);
+            self->socket.connect(std::string([address UTF8String]));
+        } catch (zmq::error_t const&) {
+            if (error != nil) {
+                *error = makeError(CppErrorCodeMsgq);
+            }
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    // The socket goes before its context.
+    self->socket.close();
+}
+
+- (NSArray<NSData*>*)request: (NSArray<NSString*>*)parts error: (NSError**)error {
+    try {
+        std::vector<zmq::message_t> request {};
+        for (NSString* part in parts) {
+            request.emplace_back(std::string_view { [part UTF8String] });
+        }
+        std::vector<zmq::message_t> reply {};
+        if (!zmq::send_multipart(self->socket, std::move(request)) ||
+            !zmq::recv_multipart(self->socket, std::back_inserter(reply))) {
+            // Timed out.
+            throw CppErrorCodeMsgq;
+        }
+
+        NSMutableArray<NSData*>* result = [NSMutableArray arrayWithCapacity: reply.size()];
+        for (auto const& message : reply) {
+            [result addObject: [NSData dataWithBytes: message.data() length: message.size()]];
+        }
+        return result;
+    } catch (CppErrorCode errorCode) {
+        if (error != nil) {
+            *error = makeError(errorCode);
+        }
+        return nil;
+    } catch (zmq::error_t const&) {
+        if (error != nil) {
+            *error = makeError(CppErrorCodeMsgq);
+        }
+        return nil;
+    }
+}
+
+@end
+
+@implementation RegolithReservoirSubscriber {
+    zmq::context_t context;
+    zmq::socket_t socket;
+}
+
+- (instancetype)initWithAddress: (NSString*)address error: (NSError**)error {
+    if (self = [super init]) {
+        try {
+            self->socket = zmq::socket_t { self->context, zmq::socket_type::sub };
+            self->socket.set(zmq::sockopt::subscribe, "");
+            // Keep every message until it is received, and look for the
+            // run often, so that little of it is missed.
+            self->socket.set(zmq::sockopt::rcvhwm, 0);
+            self->socket.set(zmq::sockopt::reconnect_ivl, 10);
+            self->socket.set(zmq::sockopt::linger, 0);
+            self->socket.connect(std::string([address UTF8String]));
+        } catch (zmq::error_t const&) {
+            if (error != nil) {
+                *error = makeError(CppErrorCodeMsgq);
+            }
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    // The socket goes before its context.
+    self->socket.close();
+}
+
+- (NSArray<NSData*>*)receiveWithTimeout: (NSTimeInterval)timeout {
+    try {
+        self->socket.set(zmq::sockopt::rcvtimeo, static_cast<int>(timeout * 1000));
+        std::vector<zmq::message_t> message {};
+        if (!zmq::recv_multipart(self->socket, std::back_inserter(message))) {
+            return nil;
+        }
+
+        NSMutableArray<NSData*>* result = [NSMutableArray arrayWithCapacity: message.size()];
+        for (auto const& part : message) {
+            [result addObject: [NSData dataWithBytes: part.data() length: part.size()]];
+        }
+        return result;
+    } catch (zmq::error_t const&) {
+        return nil;
+    }
+}
+
+@end
+
+@interface RegolithReservoirIndex ()
+- (rr::RestingIndex*)restingIndex;
+@end
+
+@implementation RegolithReservoirIndex {
+    rr::RestingIndex index;
+}
+
+- (rr::RestingIndex*)restingIndex {
+    return &self->index;
+}
+
+- (NSInteger)count {
+    return self->index.size();
+}
+
+- (NSInteger)columnOfGrain: (NSInteger)grain {
+    return self->index.getRestingCoordinate(static_cast<int>(grain)).x;
+}
+
+- (NSInteger)rowOfGrain: (NSInteger)grain {
+    return self->index.getRestingCoordinate(static_cast<int>(grain)).y;
+}
+
+- (NSInteger)findGrainAtColumn: (NSInteger)x row: (NSInteger)y {
+    auto grain = self->index.findGrainAt({ static_cast<int>(x), static_cast<int>(y) });
+    return grain ? *grain : NSNotFound;
+}
+
+- (NSInteger)findFirstGrainInRow: (NSInteger)y {
+    auto grain = self->index.findFirstGrainInRow(static_cast<int>(y));
+    return grain ? *grain : NSNotFound;
+}
+
+- (NSInteger)countGrainsAfter: (NSInteger)steps fromColumn: (NSInteger)from toColumn: (NSInteger)to {
+    return self->index.countGrains(static_cast<int>(steps), { static_cast<int>(from), static_cast<int>(to) });
+}
+
+@end
+
+@implementation RegolithReservoirOptions
+
+- (instancetype)init {
+    if (self = [super init]) {
+        rr::Options options {};
+        self.maxReplayCost = options.recordingBudget.maxReplayCost;
+        self.maxMemory = options.recordingBudget.maxMemory;
+        self.streamCapacity = options.streamCapacity;
+        NSMutableArray<NSNumber*>* spawnPoints = [NSMutableArray arrayWithCapacity: options.spawnPoints.size()];
+        for (auto spawnPoint : options.spawnPoints) {
+            [spawnPoints addObject: @(spawnPoint.x)];
+        }
+        self.spawnPoints = spawnPoints;
+    }
+    return self;
+}
+
+@end
+
+@implementation RegolithReservoirFrames {
+    std::unique_ptr<rr::SnapshotArchive> archive;
+    std::unique_ptr<rr::FrameCache> frames;
+}
+
+- (instancetype)initWithArchive: (NSString*)path error: (NSError**)error {
+    return [self initWithArchive: path capacity: 8 error: error];
+}
+
+- (instancetype)initWithArchive: (NSString*)path capacity: (NSInteger)capacity error: (NSError**)error {
+    if (self = [super init]) {
+        try {
+            self->archive = std::make_unique<rr::SnapshotArchive>(std::string([path UTF8String]));
+            self->frames = std::make_unique<rr::FrameCache>(rr::SnapshotSource { self->archive.get() }, static_cast<size_t>(std::max<NSInteger>(0, capacity)));
+        } catch (CppErrorCode errorCode) {
+            if (error != nil) {
+                *error = makeError(errorCode);
+            }
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (NSInteger)count {
+    return self->frames->size();
+}
+
+- (NSString*)loadFrame: (NSInteger)index error: (NSError**)error {
+    if (index < 0 || index >= self.count) {
+        if (error != nil) {
+            *error = makeError(CppErrorCodeInput);
+        }
+        return nil;
+    }
+    auto frame = self->frames->load(static_cast<int>(index));
+    return [NSString stringWithUTF8String: frame.c_str()];
+}
+
+- (NSData*)loadEncodedFrame: (NSInteger)index error: (NSError**)error {
+    if (index < 0 || index >= self.count) {
+        if (error != nil) {
+            *error = makeError(CppErrorCodeInput);
+        }
+        return nil;
+    }
+    auto message = self->frames->loadEncoded(static_cast<int>(index));
+    return [NSData dataWithBytes: message.data() length: message.size()];
+}
+
+- (NSData*)loadChangesFrom: (NSInteger)base to: (NSInteger)index {
+    if (base < 0 || base >= self.count || index < 0 || index >= self.count) {
+        return nil;
+    }
+    if (auto changes = self->frames->loadChanges(static_cast<int>(base), static_cast<int>(index))) {
+        return [NSData dataWithBytes: changes->data() length: changes->size()];
+    } else {
+        return nil;
+    }
+}
+
+@end
+
+/// The storage of the options, as <code>rr::Storage</code>.
+static rr::Storage makeStorage(RegolithReservoirStorage storage) {
+    switch (storage) {
+        case RegolithReservoirStorageBuckets:
+            return rr::Storage::Buckets;
+
+        case RegolithReservoirStorageGrid:
+            return rr::Storage::Grid;
+
+        case RegolithReservoirStorageTiles:
+            return rr::Storage::Tiles;
+    }
+    throw CppErrorCodeInput;
+}
+
+/// The strategy of the options, as <code>rr::Strategy</code>.
+static rr::Strategy makeStrategy(RegolithReservoirStrategy strategy) {
+    switch (strategy) {
+        case RegolithReservoirStrategyFromSpawn:
+            return rr::Strategy::FromSpawn;
+
+        case RegolithReservoirStrategyResumePath:
+            return rr::Strategy::ResumePath;
+
+        case RegolithReservoirStrategyRowPropagation:
+            return rr::Strategy::RowPropagation;
+
+        case RegolithReservoirStrategyPipelined:
+            return rr::Strategy::Pipelined;
+    }
+    throw CppErrorCodeInput;
+}
+
+/// The spawn policy of the options, as <code>rr::SpawnPolicy</code>.
+static rr::SpawnPolicy makeSpawnPolicy(RegolithReservoirSpawnPolicy spawnPolicy) {
+    switch (spawnPolicy) {
+        case RegolithReservoirSpawnPolicyRoundRobin:
+            return rr::SpawnPolicy::RoundRobin;
+
+        case RegolithReservoirSpawnPolicyPriority:
+            return rr::SpawnPolicy::Priority;
+    }
+    throw CppErrorCodeInput;
+}
+
+/// The options of the run, or the default ones if there are none.
+static rr::Options makeOptions(RegolithReservoirOptions* options) {
+    rr::Options result {};
+    if (options != nil) {
+        result.storage = makeStorage(options.storage);
+        result.strategy = makeStrategy(options.strategy);
+        result.recordingBudget.maxReplayCost = static_cast<size_t>(std::max<NSInteger>(0, options.maxReplayCost));
+        result.recordingBudget.maxMemory = static_cast<size_t>(std::max<NSInteger>(0, options.maxMemory));
+        if (options.tracePath != nil) {
+            result.tracePath = std::string([options.tracePath UTF8String]);
+        }
+        if (options.archivePath != nil) {
+            result.archivePath = std::string([options.archivePath UTF8String]);
+        }
+        if (options.streamAddress != nil) {
+            result.streamAddress = std::string([options.streamAddress UTF8String]);
+        }
+        result.streamCapacity = static_cast<size_t>(std::max<NSInteger>(1, options.streamCapacity));
+        if (options.service != nil) {
+            result.service = [options.service service];
+        }
+        if (options.spawnPoints != nil) {
+            result.spawnPoints.clear();
+            for (NSNumber* x in options.spawnPoints) {
+                result.spawnPoints.push_back({ static_cast<int>(x.integerValue), rr::SPAWN_POINT.y });
+            }
+        }
+        result.spawnPolicy = makeSpawnPolicy(options.spawnPolicy);
+        if (options.restingIndex != nil) {
+            result.restingIndex = [options.restingIndex restingIndex];
+        }
+    }
+    return result;
+}
+
 @implementation RegolithReservoirWrapper
 
 + (NSString*)runPart1: (NSString*)input withVisualisation: (BOOL) enableVisualisation error: (NSError**)error {
-    auto answer = rr::runPart1(std::move([input cStringUsingEncoding:NSUTF8StringEncoding]), enableVisualisation);
-    return [NSString stringWithCString: answer.c_str() encoding:NSUTF8StringEncoding];
+    return [self runPart1: input withVisualisation: enableVisualisation options: nil error: error];
 }
 
 + (NSString*)runPart2: (NSString*)input withVisualisation: (BOOL) enableVisualisation error: (NSError**)error {
-    auto answer = rr::runPart2(std::move([input cStringUsingEncoding:NSUTF8StringEncoding]), enableVisualisation);
-    return [NSString stringWithCString: answer.c_str() encoding:NSUTF8StringEncoding];
+    return [self runPart2: input withVisualisation: enableVisualisation options: nil error: error];
+}
+
++ (NSString*)runPart1: (NSString*)input withVisualisation: (BOOL) enableVisualisation options: (RegolithReservoirOptions*)options error: (NSError**)error {
+    try {
+        auto answer = rr::runPart1(std::move([input cStringUsingEncoding:NSUTF8StringEncoding]), enableVisualisation, makeOptions(options));
+        return [NSString stringWithCString: answer.c_str() encoding:NSUTF8StringEncoding];
+    } catch (CppErrorCode errorCode) {
+        if (error != nil) {
+            *error = makeError(errorCode);
+        }
+        return nil;
+    }
+}
+
++ (NSString*)runPart2: (NSString*)input withVisualisation: (BOOL) enableVisualisation options: (RegolithReservoirOptions*)options error: (NSError**)error {
+    try {
+        auto answer = rr::runPart2(std::move([input cStringUsingEncoding:NSUTF8StringEncoding]), enableVisualisation, makeOptions(options));
+        return [NSString stringWithCString: answer.c_str() encoding:NSUTF8StringEncoding];
+    } catch (CppErrorCode errorCode) {
+        if (error != nil) {
+            *error = makeError(errorCode);
+        }
+        return nil;
+    }
+}
+
++ (NSInteger)findParseError: (NSString*)input {
+    auto parsed = rr::Wall::parse(std::string_view([input UTF8String]));
+    if (auto parseError = std::get_if<rr::ParseError>(&parsed)) {
+        return parseError->offset;
+    } else {
+        return NSNotFound;
+    }
+}
+
++ (NSString*)decodeTrace: (NSString*)path error: (NSError**)error {
+    try {
+        auto text = rr::Trace::decode(std::string([path UTF8String]));
+        return [NSString stringWithUTF8String: text.c_str()];
+    } catch (CppErrorCode errorCode) {
+        if (error != nil) {
+            *error = makeError(errorCode);
+        }
+        return nil;
+    }
 }
 
 @end
@@ -32,4 +32,555 @@ final class aoc2022Tests: XCTestCase {
         }
     }
 
+    // MARK: - Day 14: Regolith Reservoir
+
+    /// The example of the puzzle.
+    private let regolithSample = """
+        498,4 -> 498,6 -> 496,6
+        503,4 -> 502,4 -> 502,9 -> 494,9
+        """
+
+    func testRegolithReservoirGridStorage() throws {
+        let options = RegolithReservoirOptions()
+        options.storage = .grid
+        try assertRegolithAnswers(options)
+    }
+
+    func testRegolithReservoirResumePath() throws {
+        for storage: RegolithReservoirStorage in [.buckets, .grid] {
+            let options = RegolithReservoirOptions()
+            options.storage = storage
+            options.strategy = .resumePath
+            try assertRegolithAnswers(options)
+        }
+    }
+
+    func testRegolithReservoirRowPropagation() throws {
+        let options = RegolithReservoirOptions()
+        options.strategy = .rowPropagation
+        let walls = makeRegolithWalls()
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: false, options: options), "93")
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(walls, withVisualisation: false, options: options),
+                       try RegolithReservoirWrapper.runPart2(walls, withVisualisation: false))
+
+        // Without a floor, the sand doesn't fill everything it can reach.
+        XCTAssertThrowsError(try RegolithReservoirWrapper.runPart1(regolithSample, withVisualisation: false, options: options))
+    }
+
+    func testRegolithReservoirTileStorage() throws {
+        for strategy: RegolithReservoirStrategy in [.fromSpawn, .resumePath] {
+            let options = RegolithReservoirOptions()
+            options.storage = .tiles
+            options.strategy = strategy
+            try assertRegolithAnswers(options)
+        }
+
+        // A wall far from the sand only costs the tiles it covers.
+        let options = RegolithReservoirOptions()
+        options.storage = .tiles
+        let walls = makeRegolithWalls() + "\n400000,3 -> 400000,5 -> 400003,5"
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart1(walls, withVisualisation: false, options: options),
+                       try RegolithReservoirWrapper.runPart1(walls, withVisualisation: false))
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(walls, withVisualisation: false, options: options),
+                       try RegolithReservoirWrapper.runPart2(walls, withVisualisation: false))
+    }
+
+    func testRegolithReservoirPipelined() throws {
+        for storage: RegolithReservoirStorage in [.buckets, .grid, .tiles] {
+            let options = RegolithReservoirOptions()
+            options.storage = storage
+            options.strategy = .pipelined
+            try assertRegolithAnswers(options)
+        }
+    }
+
+    func testRegolithReservoirArchivesTheRun() throws {
+        let path = makeRegolithArchivePath("archive")
+        let options = RegolithReservoirOptions()
+        options.archivePath = path
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart1(regolithSample, withVisualisation: true, options: options), "24")
+        XCTAssertTrue(FileManager.default.fileExists(atPath: path))
+        XCTAssertFalse(FileManager.default.fileExists(atPath: path + ".partial"))
+
+        // A frame before the first grain, and one after each grain.
+        let frames = try RegolithReservoirFrames(archive: path)
+        XCTAssertEqual(frames.count, 25)
+        for index in 0..<frames.count {
+            XCTAssertEqual(try frames.loadFrame(index).filter { $0 == "o" }.count, index)
+        }
+        XCTAssertThrowsError(try frames.loadFrame(frames.count))
+        XCTAssertThrowsError(try RegolithReservoirFrames(archive: path + ".missing"))
+    }
+
+    func testRegolithReservoirFramesWidenWithThePile() throws {
+        let path = makeRegolithArchivePath("widen")
+        let options = RegolithReservoirOptions()
+        options.archivePath = path
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: true, options: options), "93")
+
+        let frames = try RegolithReservoirFrames(archive: path)
+        XCTAssertEqual(frames.count, 94)
+        // The last row is the floor, as wide as the frame.
+        func countWalls(_ rows: [Substring]) -> Int {
+            return rows.dropLast().joined().filter { $0 == "#" }.count
+        }
+        let walls = countWalls(try frames.loadFrame(0).split(separator: "\n"))
+        var widths: [Int] = []
+        for index in 0..<frames.count {
+            let rows = try frames.loadFrame(index).split(separator: "\n")
+            XCTAssertEqual(Set(rows.map { $0.count }).count, 1, "frame \(index)")
+            XCTAssertEqual(rows.joined().filter { $0 == "o" }.count, index, "frame \(index)")
+            XCTAssertEqual(countWalls(rows), walls, "frame \(index)")
+            XCTAssertEqual(rows.last.map { Set($0) }, ["#"], "frame \(index)")
+            widths.append(rows[0].count)
+        }
+
+        // The pile spreads past the walls on both sides.
+        XCTAssertEqual(widths, widths.sorted())
+        XCTAssertGreaterThan(widths.last!, widths.first!)
+    }
+
+    func testRegolithReservoirFramesStepBackward() throws {
+        let path = makeRegolithArchivePath("backward")
+        let options = RegolithReservoirOptions()
+        options.archivePath = path
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: true, options: options), "93")
+
+        let forward = try RegolithReservoirFrames(archive: path)
+        let expected = try (0..<forward.count).map { try forward.loadFrame($0) }
+
+        // Stepping back rebuilds the frames from the cached ones, which
+        // must not change what they show.
+        let backward = try RegolithReservoirFrames(archive: path, capacity: 2)
+        for index in stride(from: backward.count - 1, through: 0, by: -1) {
+            XCTAssertEqual(try backward.loadFrame(index), expected[index], "frame \(index)")
+        }
+        for index in [50, 3, 93, 92, 0, 47, 46, 45] {
+            XCTAssertEqual(try backward.loadFrame(index), expected[index], "frame \(index)")
+        }
+    }
+
+    func testRegolithReservoirSmallBudgetKeepsTheFrames() throws {
+        let path = makeRegolithArchivePath("budget")
+        let options = RegolithReservoirOptions()
+        options.archivePath = path
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: true, options: options), "93")
+
+        // Rebuilding a frame may hardly cost more than copying one, so
+        // there are many more checkpoints.
+        let smallPath = makeRegolithArchivePath("small-budget")
+        options.archivePath = smallPath
+        options.maxReplayCost = 512
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: true, options: options), "93")
+
+        let size = try FileManager.default.attributesOfItem(atPath: path)[.size] as! Int
+        let smallSize = try FileManager.default.attributesOfItem(atPath: smallPath)[.size] as! Int
+        XCTAssertGreaterThan(smallSize, size)
+
+        let frames = try RegolithReservoirFrames(archive: path)
+        let smallFrames = try RegolithReservoirFrames(archive: smallPath, capacity: 2)
+        XCTAssertEqual(smallFrames.count, frames.count)
+        for index in 0..<frames.count {
+            XCTAssertEqual(try smallFrames.loadFrame(index), try frames.loadFrame(index), "frame \(index)")
+        }
+    }
+
+    func testRegolithReservoirServiceAnswersClientsAtOnce() throws {
+        let address = "tcp://127.0.0.1:22151"
+        let service = try RegolithReservoirService(address: address, workers: 4)
+        let path = makeRegolithArchivePath("service")
+        let options = RegolithReservoirOptions()
+        options.archivePath = path
+        options.service = service
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: true, options: options), "93")
+
+        let frames = try RegolithReservoirFrames(archive: path)
+        let expected = try (0..<frames.count).map { try frames.loadFrame($0) }
+
+        // Each client goes through the frames from a step of its own,
+        // so the workers build different frames at once.
+        let clients = 8
+        let lock = NSLock()
+        var failures: [String] = []
+        DispatchQueue.concurrentPerform(iterations: clients) { client in
+            do {
+                let connection = try RegolithReservoirClient(address: address)
+                for step in 0..<expected.count {
+                    let index = (client * 11 + step) % expected.count
+                    let reply = try connection.request(["GET", "\(index)"])
+                    if reply.count != 2 || String(decoding: reply[0], as: UTF8.self) != "OK" ||
+                        String(decoding: reply[1], as: UTF8.self) != expected[index] {
+                        lock.lock()
+                        failures.append("client \(client), frame \(index)")
+                        lock.unlock()
+                    }
+                }
+            } catch {
+                lock.lock()
+                failures.append("client \(client): \(error)")
+                lock.unlock()
+            }
+        }
+        XCTAssertEqual(failures, [])
+
+        let connection = try RegolithReservoirClient(address: address)
+        XCTAssertEqual(try connection.request(["GET", "\(expected.count)"]), [Data("ERROR".utf8)])
+        XCTAssertEqual(try connection.request(["GOT", "1"]), [Data("ERROR".utf8)])
+
+        // A client that is done doesn't take the frames from the others.
+        XCTAssertEqual(try connection.request(["STOP"]), [Data("OK".utf8)])
+        XCTAssertEqual(try connection.request(["GET", "7"]), [Data("OK".utf8), Data(expected[7].utf8)])
+        service.stop()
+    }
+
+    func testRegolithReservoirStreamsTheRunAsItGoes() throws {
+        let service = try RegolithReservoirService(address: "tcp://127.0.0.1:22152", workers: 1)
+        let address = "tcp://127.0.0.1:22153"
+        let subscriber = try RegolithReservoirSubscriber(address: address)
+        let path = makeRegolithArchivePath("stream")
+        let options = RegolithReservoirOptions()
+        options.service = service
+        options.archivePath = path
+        options.streamAddress = address
+        // A checkpoint every couple of hundred grains.
+        options.maxReplayCost = 1 << 16
+        let walls = makeRegolithWalls()
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(walls, withVisualisation: true, options: options),
+                       try RegolithReservoirWrapper.runPart2(walls, withVisualisation: false))
+
+        // The subscriber misses the start of the run, and a slow one
+        // may miss more, but whatever it gets adds up to the frames of
+        // the archive.
+        let frames = try RegolithReservoirFrames(archive: path)
+        var checkpoints = 0
+        var rebuilt = 0
+        var last: (index: Int, bounds: [Int], rows: [[Character]])? = nil
+        while let message = subscriber.receive(timeout: 1) {
+            let kind = String(decoding: message[0], as: UTF8.self)
+            let index = Int(String(decoding: message[1], as: UTF8.self))!
+            if kind == "CHECKPOINT" {
+                let (bounds, rows) = decodeRegolithFrame(message[2])
+                XCTAssertEqual(rows.map { String($0) + "\n" }.joined(), try frames.loadFrame(index), "frame \(index)")
+                last = (index, bounds, rows)
+                checkpoints += 1
+            } else if kind == "DELTA", var frame = last, frame.index == index - 1 {
+                let x = Int(String(decoding: message[2], as: UTF8.self))! - frame.bounds[0]
+                let y = Int(String(decoding: message[3], as: UTF8.self))! - frame.bounds[1]
+                guard x >= 0 && x < frame.bounds[2] else {
+                    // The frame widens, so wait for the next checkpoint.
+                    last = nil
+                    continue
+                }
+                frame.rows[y][x] = "o"
+                frame.index = index
+                if index % 97 == 0 {
+                    XCTAssertEqual(frame.rows.map { String($0) + "\n" }.joined(), try frames.loadFrame(index), "frame \(index)")
+                    rebuilt += 1
+                }
+                last = frame
+            } else {
+                // A snapshot was dropped.
+                last = nil
+            }
+        }
+        XCTAssertGreaterThan(checkpoints, 0)
+        XCTAssertGreaterThan(rebuilt, 0)
+        service.stop()
+    }
+
+    func testRegolithReservoirServiceAnswersRanges() throws {
+        let address = "tcp://127.0.0.1:22154"
+        let service = try RegolithReservoirService(address: address, workers: 2)
+        let path = makeRegolithArchivePath("range")
+        let options = RegolithReservoirOptions()
+        options.archivePath = path
+        options.service = service
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart1(regolithSample, withVisualisation: true, options: options), "24")
+
+        let frames = try RegolithReservoirFrames(archive: path)
+        let expected = try (0..<frames.count).map { Data(try frames.loadFrame($0).utf8) }
+        let connection = try RegolithReservoirClient(address: address)
+        XCTAssertEqual(try connection.request(["GETRANGE", "0", "24"]), [Data("OK".utf8)] + expected)
+        XCTAssertEqual(try connection.request(["GETRANGE", "3", "20", "5"]), [Data("OK".utf8)] + [3, 8, 13, 18].map { expected[$0] })
+        XCTAssertEqual(try connection.request(["GETRANGE", "7", "7"]), [Data("OK".utf8), expected[7]])
+
+        for request in [["GETRANGE", "5", "4"], ["GETRANGE", "0", "25"], ["GETRANGE", "-1", "3"],
+                        ["GETRANGE", "0", "3", "0"], ["GETRANGE", "0"], ["GETRANGE", "a", "3"]] {
+            XCTAssertEqual(try connection.request(request), [Data("ERROR".utf8)], "\(request)")
+        }
+        service.stop()
+    }
+
+    func testRegolithReservoirChangesRebuildTheFrames() throws {
+        let address = "tcp://127.0.0.1:22155"
+        let service = try RegolithReservoirService(address: address, workers: 2)
+        let path = makeRegolithArchivePath("changes")
+        let options = RegolithReservoirOptions()
+        options.archivePath = path
+        options.service = service
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: true, options: options), "93")
+
+        let frames = try RegolithReservoirFrames(archive: path)
+        var rebuilt = 0
+        for index in 1..<frames.count {
+            for base in [index - 1, max(0, index - 7)] {
+                guard let changes = frames.loadChanges(from: base, to: index) else {
+                    // The whole frame is smaller.
+                    continue
+                }
+                let baseFrame = try frames.loadFrame(base)
+                let baseBounds = readRegolithBounds(try frames.loadEncodedFrame(base))
+                XCTAssertEqual(applyRegolithChanges(changes, to: baseFrame, bounds: baseBounds), try frames.loadFrame(index), "frame \(index) from \(base)")
+                rebuilt += 1
+            }
+        }
+        XCTAssertGreaterThan(rebuilt, 0)
+
+        // The service answers GETDELTA the same way.
+        let connection = try RegolithReservoirClient(address: address)
+        XCTAssertEqual(try connection.request(["GETDELTA", "5"]), [Data("OK".utf8), Data("FRAME".utf8), try frames.loadEncodedFrame(5)])
+        if let changes = frames.loadChanges(from: 40, to: 41) {
+            XCTAssertEqual(try connection.request(["GETDELTA", "41", "40"]), [Data("OK".utf8), Data("CHANGES".utf8), changes])
+        }
+        XCTAssertEqual(try connection.request(["GETDELTA", "94"]), [Data("ERROR".utf8)])
+        XCTAssertEqual(try connection.request(["GETDELTA", "5", "94"]), [Data("ERROR".utf8)])
+        service.stop()
+    }
+
+    func testRegolithReservoirSpawnPointsSplitTheCave() throws {
+        // The regions of the sand of 500 and 700 never meet, while the
+        // ones of 500 and 510 merge.  Only the run without the
+        // visualisation simulates the regions on threads.
+        for spawnPoints in [[500, 700], [500, 510]] {
+            for spawnPolicy: RegolithReservoirSpawnPolicy in [.roundRobin, .priority] {
+                let options = RegolithReservoirOptions()
+                options.spawnPoints = spawnPoints.map { NSNumber(value: $0) }
+                options.spawnPolicy = spawnPolicy
+                let label = "spawn points \(spawnPoints), policy \(spawnPolicy.rawValue)"
+                for walls in [regolithSample, makeRegolithWalls()] {
+                    XCTAssertEqual(try RegolithReservoirWrapper.runPart2(walls, withVisualisation: false, options: options),
+                                   try RegolithReservoirWrapper.runPart2(walls, withVisualisation: true, options: options), label)
+                }
+            }
+        }
+
+        // The sand of a single spawn point fills a triangle up to it.
+        let options = RegolithReservoirOptions()
+        options.spawnPoints = [500, 700]
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: false, options: options), "\(93 + 12 * 12)")
+
+        options.spawnPoints = [500, 500]
+        XCTAssertThrowsError(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: false, options: options))
+    }
+
+    func testRegolithReservoirFramesStepBackToTheSpawnPoints() throws {
+        let path = makeRegolithArchivePath("spawn-points")
+        let options = RegolithReservoirOptions()
+        options.archivePath = path
+        options.spawnPoints = [500, 510]
+        _ = try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: true, options: options)
+
+        let forward = try RegolithReservoirFrames(archive: path)
+        let expected = try (0..<forward.count).map { try forward.loadFrame($0) }
+        XCTAssertEqual(expected[0].filter { $0 == "+" }.count, 2)
+
+        // Stepping back past the grain that blocked a spawn point shows
+        // the spawn point again.
+        let backward = try RegolithReservoirFrames(archive: path, capacity: 2)
+        for index in stride(from: backward.count - 1, through: 0, by: -1) {
+            XCTAssertEqual(try backward.loadFrame(index), expected[index], "frame \(index)")
+        }
+    }
+
+    func testRegolithReservoirIndexCountsGrains() throws {
+        let index = RegolithReservoirIndex()
+        let options = RegolithReservoirOptions()
+        options.restingIndex = index
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: false, options: options), "93")
+        XCTAssertEqual(index.count, 93)
+
+        let columns = (0..<index.count).map { index.column(ofGrain: $0) }
+        for steps in 0...index.count {
+            for from in stride(from: 480, through: 510, by: 3) {
+                for to in [from - 1, from, from + 4, from + 20] {
+                    let expected = columns[0..<steps].filter { $0 >= from && $0 <= to }.count
+                    XCTAssertEqual(index.countGrains(after: steps, from: from, to: to), expected, "\(steps) steps, columns \(from) to \(to)")
+                }
+            }
+        }
+    }
+
+    func testRegolithReservoirIndexFindsGrains() throws {
+        let index = RegolithReservoirIndex()
+        let options = RegolithReservoirOptions()
+        options.restingIndex = index
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: false, options: options), "93")
+
+        var firstGrainsOfRows: [Int: Int] = [:]
+        for grain in 0..<index.count {
+            let x = index.column(ofGrain: grain), y = index.row(ofGrain: grain)
+            XCTAssertEqual(index.findGrain(atColumn: x, row: y), grain)
+            firstGrainsOfRows[y] = min(firstGrainsOfRows[y] ?? grain, grain)
+        }
+        for y in -1...12 {
+            XCTAssertEqual(index.findFirstGrain(inRow: y), firstGrainsOfRows[y] ?? NSNotFound, "row \(y)")
+        }
+
+        // The last grain blocks the spawn point, and none rest in the
+        // walls.
+        XCTAssertEqual(index.findGrain(atColumn: 500, row: 0), 92)
+        XCTAssertEqual(index.findFirstGrain(inRow: 0), 92)
+        XCTAssertEqual(index.findGrain(atColumn: 498, row: 4), NSNotFound)
+        XCTAssertEqual(index.findGrain(atColumn: 0, row: 0), NSNotFound)
+    }
+
+    func testRegolithReservoirTraceRoundTrips() throws {
+        let path = makeRegolithArchivePath("trace")
+        let options = RegolithReservoirOptions()
+        options.tracePath = path
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart1(regolithSample, withVisualisation: false, options: options), "24")
+
+        // A header, and then a line for each step, from the first grain
+        // to the one that fell out of the cave.
+        let lines = try RegolithReservoirWrapper.decodeTrace(path).split(separator: "\n").map(String.init)
+        XCTAssertEqual(lines.first, "TRACE:[RECORDS:\(lines.count - 1),DROPPED:0]")
+        XCTAssertEqual(lines.dropFirst().first, "GRAIN:0 [TYPE:Spawn,[COORD:500,0]]")
+        XCTAssertEqual(lines.last, "GRAIN:24 [TYPE:Destroy,[COORD:493,9]]")
+        XCTAssertTrue(lines.dropFirst().allSatisfy { $0.hasPrefix("GRAIN:") })
+
+        XCTAssertThrowsError(try RegolithReservoirWrapper.decodeTrace(path + ".missing"))
+        let archivePath = makeRegolithArchivePath("not-a-trace")
+        options.tracePath = nil
+        options.archivePath = archivePath
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart1(regolithSample, withVisualisation: true, options: options), "24")
+        XCTAssertThrowsError(try RegolithReservoirWrapper.decodeTrace(archivePath))
+    }
+
+    func testRegolithReservoirReportsParseErrorOffsets() throws {
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError(regolithSample), NSNotFound)
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError(""), NSNotFound)
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError("  5,5  ->  6,5  \n\n7,7"), NSNotFound)
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError("498,4 -> x"), 9)
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError("498,4 => 1,2"), 6)
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError("498;4"), 3)
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError("1,99999999999"), 2)
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError("1,2 -> 3,4 ->"), 13)
+        XCTAssertEqual(RegolithReservoirWrapper.findParseError("1,2\n3"), 5)
+        XCTAssertThrowsError(try RegolithReservoirWrapper.runPart1("498,4 -> oops", withVisualisation: false))
+    }
+
+    // MARK: Helpers of the Regolith Reservoir tests
+
+    /// Checks the answers of a run with the options, on the example and
+    /// against a run with the default options.
+    private func assertRegolithAnswers(_ options: RegolithReservoirOptions, file: StaticString = #filePath, line: UInt = #line) throws {
+        let walls = makeRegolithWalls()
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart1(regolithSample, withVisualisation: false, options: options), "24", file: file, line: line)
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(regolithSample, withVisualisation: false, options: options), "93", file: file, line: line)
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart1(walls, withVisualisation: false, options: options),
+                       try RegolithReservoirWrapper.runPart1(walls, withVisualisation: false), file: file, line: line)
+        XCTAssertEqual(try RegolithReservoirWrapper.runPart2(walls, withVisualisation: false, options: options),
+                       try RegolithReservoirWrapper.runPart2(walls, withVisualisation: false), file: file, line: line)
+    }
+
+    /// Paths of walls around the spawn point, the same on every run.
+    private func makeRegolithWalls(count: Int = 40) -> String {
+        var seed: UInt32 = 14
+        func next(_ bound: Int) -> Int {
+            seed = seed &* 1664525 &+ 1013904223
+            return Int(seed >> 16) % bound
+        }
+
+        var paths: [String] = []
+        for _ in 0..<count {
+            var x = 470 + next(60)
+            var y = 5 + next(60)
+            var points = ["\(x),\(y)"]
+            for turn in 0...next(3) {
+                if turn % 2 == 0 {
+                    x += next(13) - 6
+                } else {
+                    y += next(9)
+                }
+                points.append("\(x),\(y)")
+            }
+            paths.append(points.joined(separator: " -> "))
+        }
+        return paths.joined(separator: "\n")
+    }
+
+    private func readRegolithInt32(_ data: Data, at offset: Int) -> Int {
+        return Int(data.withUnsafeBytes { $0.loadUnaligned(fromByteOffset: offset, as: Int32.self) })
+    }
+
+    /// Reads the bounds a frame or its changes start with: x, y, width
+    /// and height.
+    private func readRegolithBounds(_ data: Data) -> [Int] {
+        return (0..<4).map { readRegolithInt32(data, at: 4 * $0) }
+    }
+
+    /// Decodes a frame encoded for the binary protocol into its bounds
+    /// and its rows, the way a client does.  See `rr::EncodedFrame`.
+    private func decodeRegolithFrame(_ message: Data) -> (bounds: [Int], rows: [[Character]]) {
+        let bounds = readRegolithBounds(message)
+        let cells: [Character] = [".", "#", "o", "+"]
+        var rows = Array(repeating: Array(repeating: Character("."), count: bounds[2]), count: bounds[3])
+        var k = 0
+        func put(_ cell: Character) {
+            if k < bounds[2] * bounds[3] {
+                rows[k / bounds[2]][k % bounds[2]] = cell
+            }
+            k += 1
+        }
+        for byte in message.dropFirst(16) {
+            if byte & 0x80 != 0 {
+                k += Int(byte & 0x7F) + 1
+            } else if byte & 0x40 != 0 {
+                for _ in 0...Int(byte & 0x3F) {
+                    put("o")
+                }
+            } else {
+                put(cells[Int(byte >> 4 & 3)])
+                put(cells[Int(byte >> 2 & 3)])
+                put(cells[Int(byte & 3)])
+            }
+        }
+        return (bounds, rows)
+    }
+
+    /// Applies the changes of GETDELTA to the base frame, the way a
+    /// client does.
+    private func applyRegolithChanges(_ changes: Data, to baseFrame: String, bounds baseBounds: [Int]) -> String {
+        let bounds = readRegolithBounds(changes)
+        let baseRows = baseFrame.split(separator: "\n", omittingEmptySubsequences: false).map { Array($0) }
+
+        // The cells the base doesn't show all come with the changes.
+        var rows: [[Character]] = []
+        for j in 0..<bounds[3] {
+            var row: [Character] = []
+            for i in 0..<bounds[2] {
+                let column = bounds[0] + i - baseBounds[0]
+                row.append(column >= 0 && column < baseBounds[2] ? baseRows[j][column] : "?")
+            }
+            rows.append(row)
+        }
+
+        let count = readRegolithInt32(changes, at: 16)
+        for k in 0..<count {
+            let offset = 20 + 5 * k
+            let cell = readRegolithInt32(changes, at: offset)
+            rows[cell / bounds[2]][cell % bounds[2]] = Character(UnicodeScalar(changes[offset + 4]))
+        }
+        return rows.map { String($0) + "\n" }.joined()
+    }
+
+    /// A file for an archive of a run, removed after the test.
+    private func makeRegolithArchivePath(_ name: String) -> String {
+        let path = (NSTemporaryDirectory() as NSString).appendingPathComponent("RegolithReservoir-\(name)-\(UUID().uuidString)")
+        addTeardownBlock {
+            try? FileManager.default.removeItem(atPath: path)
+        }
+        return path
+    }
+
 }